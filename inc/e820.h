@@ -0,0 +1,36 @@
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// The BIOS physical memory map, as returned by INT 15h, AX=E820h.
+// The boot loader collects it before leaving real mode and leaves it at
+// physical address E820_MAP, in page 0, which the kernel never allocates.
+
+#define E820_MAP	0x500		// Physical address of struct E820Map
+#define E820_MAX	32		// Maximum number of entries
+#define E820_ENTSZ	20		// Size of one entry
+#define E820_SMAP	0x534d4150	// 'SMAP' signature
+
+// Values of the e820_type field
+#define E820_RAM	1		// Usable memory
+#define E820_RESERVED	2		// Reserved, e.g. ROMs and MMIO
+#define E820_ACPI	3		// ACPI tables, reclaimable
+#define E820_NVS	4		// ACPI non-volatile storage
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct E820Entry {
+	uint64_t e820_addr;		// Start of the range
+	uint64_t e820_len;		// Length of the range in bytes
+	uint32_t e820_type;		// E820_RAM, E820_RESERVED, ...
+} __attribute__((packed));
+
+struct E820Map {
+	uint32_t nr;			// Number of valid entries in map[]
+	struct E820Entry map[E820_MAX];
+} __attribute__((packed));
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
@@ -38,6 +38,21 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// A range of an environment's address space that is allocated on demand:
+// each page in [er_start, er_end) is mapped to a fresh zero-filled page,
+// with permissions er_perm, the first time it is touched.
+struct EnvRegion {
+	uintptr_t er_start;
+	uintptr_t er_end;
+	int er_perm;
+};
+
+#define ENV_NREGIONS		8	// Lazy regions per environment
+
+// Scheduling priorities, for sys_env_set_priority: 0 runs first, and
+// ENV_NPRIORITY - 1 last.  Environments start out at priority 0.
+#define ENV_NPRIORITY		4
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -52,8 +67,33 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 
+	// Scheduling (see kern/sched.h)
+	struct Env *env_rq_next;	// Next env on the run queue
+	struct Env *env_rq_prev;	// Previous env on the run queue
+	int env_cpu;			// CPU whose run queue it goes on
+	int env_priority;		// Highest level the env may run at
+	int env_level;			// Level the env runs at now
+	int env_slice;			// Timer ticks left at this level
+	uint32_t env_epoch;		// Priority boosts its level is up to date with
+	uint64_t env_runtime;		// TSC cycles spent running
+	uint64_t env_waittime;		// TSC cycles spent runnable but waiting
+	uint64_t env_stamp;		// TSC when it last started running or waiting
+
+	// Deadline scheduling, in timer ticks (see kern/sched.h)
+	struct Env *env_dl_next;	// Next env on the deadline list
+	uint32_t env_dl_runtime;	// CPU time each job gets
+	uint32_t env_dl_period;		// Time between jobs; 0 if best-effort
+	uint32_t env_dl_deadline;	// Time after its release a job is due
+	uint32_t env_dl_budget;		// CPU time the current job has left
+	uint32_t env_dl_due;		// When the current job is due
+	uint32_t env_dl_release;	// When the next job is released
+	uint32_t env_dl_jobs;		// Jobs released
+	uint32_t env_dl_misses;		// Jobs that missed their deadline
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	struct EnvRegion env_regions[ENV_NREGIONS];	// Demand-zero regions
+	int env_nregions;		// Number of regions in use
 };
 
 #endif // !JOS_INC_ENV_H
@@ -14,6 +14,8 @@ enum {
 				// the maximum allowed
 	E_FAULT		= 6,	// Memory fault
 	E_NO_SYS	= 7,	// Unimplemented system call
+	E_IO		= 8,	// Disk I/O error
+	E_BUSY		= 9,	// Resource already committed elsewhere
 
 	MAXERROR
 };
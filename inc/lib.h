@@ -22,6 +22,21 @@
 // main user program
 void	umain(int argc, char **argv);
 
+// Returns the PTE for the page at 'va', as uvpt[PGNUM(va)] would, or 0 if
+// there is no page table for it.  For a 4MB page, returns an entry made
+// up from its page directory entry, with PTE_PS set.
+static inline pte_t
+uvpt_pte(const volatile void *va)
+{
+	pde_t pde = uvpd[PDX(va)];
+
+	if (!(pde & PTE_P))
+		return 0;
+	if (pde & PTE_PS)
+		return (PDE_PS_ADDR(pde) + PTX(va) * PGSIZE) | (pde & 0xFFF);
+	return uvpt[PGNUM(va)];
+}
+
 // libmain.c or entry.S
 extern const char *binaryname;
 extern const volatile struct Env *thisenv;
@@ -31,6 +46,9 @@ extern const volatile struct PageInfo pages[];
 // exit.c
 void	exit(void);
 
+// fork.c
+envid_t	fork(void);
+
 // readline.c
 char*	readline(const char *buf);
 
@@ -39,6 +57,12 @@ void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
+envid_t	sys_fork(void);
+int	sys_page_alloc(envid_t env, void *pg, int perm);
+void	sys_yield(void);
+int	sys_env_set_priority(envid_t env, int priority);
+int	sys_sched_setattr(envid_t env, uint32_t runtime, uint32_t period,
+			  uint32_t deadline);
 
 
 
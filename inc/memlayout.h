@@ -43,8 +43,10 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
- *                     |       Memory-mapped I/O      | RW/--  PTSIZE
+ *                     +------------------------------+                   |
+ *                     |      Temporary Mappings      | RW/--  KMAPSIZE   |
+ *    MMIOLIM, ----->  +------------------------------+ 0xefc00000      --+
+ *    KMAPBASE -/      |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
@@ -92,11 +94,21 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// Each application processor starts up in real mode at this physical
+// address, where boot_aps copies kern/mpentry.S.  It must be below 64KB
+// and page aligned.
+#define MPENTRY_PADDR	0x7000
+
 // Kernel stack.
 #define KSTACKTOP	KERNBASE
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
 #define KSTKGAP		(8*PGSIZE)   		// size of a kernel stack guard
 
+// Temporary kernel mappings of highmem pages (see kmap), at the bottom
+// of the kernel stack PDE, far below the last CPU's kernel stack.
+#define KMAPBASE	(KSTACKTOP - PTSIZE)
+#define KMAPSIZE	(256*PGSIZE)		// size of the kmap area
+
 // Memory-mapped IO.
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
@@ -157,6 +169,11 @@ typedef uint32_t pde_t; // page directory entry or page directory
  * A second consequence is that the contents of the current page directory
  * will always be available at virtual address (UVPT + (UVPT >> PGSHIFT)), to
  * which uvpd is set in entry.S.
+ *
+ * A page directory entry with PTE_PS set maps a 4MB page rather than a page
+ * table, so the part of uvpt that would hold its PTEs shows the first 4KB
+ * of the 4MB page's data instead.  Check uvpd first, as uvpt_pte in
+ * inc/lib.h does.
  */
 extern volatile pte_t uvpt[];     // VA of "virtual page table"
 extern volatile pde_t uvpd[];     // VA of current page directory
@@ -173,8 +190,25 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous blocks on the free list.  Only meaningful for
+	// the first page of a free block.
 	struct PageInfo *pp_link;
+	union {
+		struct PageInfo *pp_prev;
+
+		// For a page table in use: how many of its entries are
+		// non-zero, so that an empty table is spotted without
+		// scanning it.
+		uint32_t pp_ptcount;
+
+		// For any other page in use: its reverse map, which
+		// finds the page table entries that map it (see
+		// kern/rmap.c).
+		uintptr_t pp_rmap;
+
+		// For a page of a slab: the slab (see kern/kmem.c).
+		struct kmem_slab *pp_slab;
+	};
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -182,7 +216,20 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// If PP_FREE is set, this page heads a free block of
+	// 2^pp_order contiguous pages in the buddy allocator.
+	// PP_KMALLOC uses pp_order the same way for an allocated block.
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
+// Values of pp_flags in struct PageInfo
+#define PP_FREE		0x01	// Heads a block on a buddy free list
+#define PP_ZERO		0x02	// Free and known to be zero-filled
+#define PP_PGTABLE	0x04	// In use as a page table (see pgtable_alloc)
+#define PP_LARGE	0x08	// Heads a block mapped as a 4MB user page
+#define PP_KMALLOC	0x10	// Heads a large kmalloc block of 2^pp_order
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -69,12 +69,24 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Copy-on-write: sys_fork shares writable pages read-only with this bit
+// set, and the first write fault gives the writer its own copy.
+#define PTE_COW		0x800
+
+// Swapped out: in a PTE without PTE_P, which the hardware ignores, the
+// page lives in the swap slot held in the address bits (see
+// kern/swap.h).  The other low bits keep the mapping's permissions.
+#define PTE_SWAP	0x040
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// Address in a page directory entry that maps a 4MB page (PTE_PS)
+#define PDE_PS_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -89,6 +101,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -96,6 +109,10 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID feature flags (returned in %edx by cpuid(1))
+#define CPUID_PSE	0x00000008	// Page Size Extensions
+#define CPUID_PGE	0x00002000	// Page Global Enable
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -7,6 +7,11 @@ enum {
 	SYS_cgetc,
 	SYS_getenvid,
 	SYS_env_destroy,
+	SYS_fork,
+	SYS_page_alloc,
+	SYS_yield,
+	SYS_env_set_priority,
+	SYS_sched_setattr,
 	NSYSCALLS
 };
 
@@ -39,6 +39,9 @@
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 
+// Inter-processor interrupts, sent between local APICs.
+#define IRQ_TLB         17	// Flush user TLB entries (see tlb_shootdown)
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
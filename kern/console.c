@@ -7,6 +7,8 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/ksm.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -459,8 +461,13 @@ getchar(void)
 {
 	int c;
 
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+	// The kernel has nothing else to do while it waits for input,
+	// so use the time to refill the pre-zeroed page pool and to look
+	// for identical pages to merge.
+	while ((c = cons_getc()) == 0) {
+		page_zero_idle();
+		ksm_scan();
+	}
 	return c;
 }
 
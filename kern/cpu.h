@@ -0,0 +1,56 @@
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Maximum number of CPUs
+#define NCPU		8
+
+// Size of a cache line.  Data that each CPU updates on its own is aligned
+// to this, so that CPUs do not steal cache lines from each other.
+#define CACHELINE	64
+
+// Values of status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
+
+// Per-CPU state
+struct CpuInfo {
+	uint8_t cpu_id;			// Index into cpus[] below
+	uint8_t cpu_apicid;		// Local APIC ID, for IPIs
+	volatile unsigned cpu_status;	// The status of the CPU
+	struct Env *cpu_env;		// The currently-running environment.
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+	volatile bool cpu_tlb_flush;	// A TLB shootdown is waiting for us
+	void (*volatile cpu_call)(void);	// Run it while waiting for the
+					// kernel lock (see lock_kernel)
+};
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+int cpunum(void);
+#define thiscpu (&cpus[cpunum()])
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(uint8_t apicid, int vector);
+
+#endif	// !JOS_KERN_CPU_H
@@ -10,10 +10,14 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
-#include <kern/monitor.h>
+#include <kern/rmap.h>
+#include <kern/swap.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;		// The current env
+int env_nlive;				// Environments allocated
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
@@ -34,7 +38,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[] =
+struct Segdesc gdt[NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -51,7 +55,8 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in trap_init_percpu()
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in trap_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL
 };
 
@@ -238,6 +243,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_runtime = 0;
+	e->env_waittime = 0;
+	e->env_nregions = 0;
+	sched_set_priority(e, 0);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -260,9 +269,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_tf.tf_cs = GD_UT | 3;
 	// You will set e->env_tf.tf_eip later.
 
+	// Enable interrupts while in user mode, so the timer can preempt it.
+	e->env_tf.tf_eflags |= FL_IF;
+
 	// commit the allocation
 	env_free_list = e->env_link;
+	env_nlive++;
 	*newenv_store = e;
+	sched_enqueue(e);
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
@@ -275,6 +289,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 // Pages should be writable by user and kernel.
 // Panic if any allocation attempt fails.
 //
+#define REGION_BATCH	32
+
 static void
 region_alloc(struct Env *e, void *va, size_t len)
 {
@@ -285,20 +301,257 @@ region_alloc(struct Env *e, void *va, size_t len)
 	//   'va' and 'len' values that are not page-aligned.
 	//   You should round va down, and round (va + len) up.
 	//   (Watch out for corner-cases!)
-    struct PageInfo *pp;
+    // Pages are allocated and mapped REGION_BATCH at a time.
+    struct PageInfo *batch[REGION_BATCH];
+    size_t n;
+    void *end = ROUNDUP(va + len, PGSIZE);
     va = ROUNDDOWN(va, PGSIZE);
-    len = ROUNDUP(len, PGSIZE);
-    void *end = va + len;
-    for (; va < end; va += PGSIZE) {
-        if (!(pp = page_alloc(0))) {
-            panic("out of memory");
+    while (va < end) {
+        for (n = 0; n < REGION_BATCH && va + n * PGSIZE < end; n++) {
+            if (!(batch[n] = page_alloc(ALLOC_HIGHMEM))) {
+                panic("out of memory");
+            }
         }
-        if (page_insert(e->env_pgdir, pp, va, PTE_U | PTE_W) < 0) {
+        if (page_insert_range(e->env_pgdir, batch, n, va, PTE_U | PTE_W) < 0) {
             panic("out of memory");
         }
+        va += n * PGSIZE;
     }
 }
 
+//
+// Record [start, end) as a demand-zero region of environment e's address
+// space, mapped with permissions 'perm' | PTE_P as it is touched.
+// 'start' and 'end' must be page-aligned.
+//
+// Returns 0 on success, -E_NO_MEM if e has no free region slots.
+//
+int
+env_region_add(struct Env *e, uintptr_t start, uintptr_t end, int perm)
+{
+	struct EnvRegion *er;
+
+	assert(start % PGSIZE == 0 && end % PGSIZE == 0 && start <= end);
+	if (start == end)
+		return 0;
+	if (e->env_nregions == ENV_NREGIONS)
+		return -E_NO_MEM;
+	er = &e->env_regions[e->env_nregions++];
+	er->er_start = start;
+	er->er_end = end;
+	er->er_perm = perm;
+	return 0;
+}
+
+//
+// If 'va' lies in one of environment e's demand-zero regions and is not
+// yet mapped, map a zeroed page there.  Unless the access is a 'write',
+// that is the shared zero page, copy-on-write if the region is writable,
+// so memory that is only ever read takes no page of its own.
+//
+// Returns 0 if a page was mapped, -E_FAULT if 'va' is not in a region
+// or already mapped or swapped out, -E_NO_MEM if out of memory.
+//
+int
+env_demand_page(struct Env *e, uintptr_t va, bool write)
+{
+	struct EnvRegion *er;
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	for (er = e->env_regions; er < e->env_regions + e->env_nregions; er++)
+		if (er->er_start <= va && va < er->er_end)
+			break;
+	if (er == e->env_regions + e->env_nregions)
+		return -E_FAULT;
+	if ((pte = pgdir_walk(e->env_pgdir, (void *) va, 0)) && *pte)
+		return -E_FAULT;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!write && page_insert_zero(e->env_pgdir, (void *) va,
+				       er->er_perm) == 0)
+		return 0;
+	if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)))
+		return -E_NO_MEM;
+	if ((r = page_insert(e->env_pgdir, pp, (void *) va, er->er_perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
+}
+
+//
+// Give 'child' a copy-on-write copy of the user part of parent's address
+// space.  Every writable page is marked read-only and PTE_COW in both
+// environments, so the work is proportional to the number of page
+// tables, not to the number of pages mapped.  4MB pages are shared the
+// same way, through their page directory entries, and swapped-out pages
+// by sharing their swap slots.  The child also inherits the parent's
+// demand-zero regions.
+//
+// Returns 0 on success, -E_NO_MEM if a page table or a reverse map entry
+// couldn't be allocated (the parent is left valid; the caller should
+// free the child).
+//
+int
+env_cow_clone(struct Env *child, struct Env *parent)
+{
+	struct PageInfo *pp;
+	struct tlb_gather tg;
+	pte_t *spt, *dpt, pte;
+	uint32_t pdeno, pteno;
+
+	// The parent's writable pages become read-only.
+	tlb_gather_init(&tg, parent->env_pgdir);
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!((pte = parent->env_pgdir[pdeno]) & PTE_P))
+			continue;
+		if (pte & PTE_PS) {
+			pp = pa2page(PDE_PS_ADDR(pte));
+			pp->pp_ref++;
+			if (rmap_add(pp, &child->env_pgdir[pdeno]) < 0) {
+				pp->pp_ref--;
+				tlb_gather_finish(&tg);
+				return -E_NO_MEM;
+			}
+			if (pte & (PTE_W | PTE_COW)) {
+				if (pte & PTE_W)
+					tlb_gather_add(&tg, (uintptr_t) PGADDR(pdeno, 0, 0));
+				pte = (pte & ~PTE_W) | PTE_COW;
+				parent->env_pgdir[pdeno] = pte;
+			}
+			child->env_pgdir[pdeno] = pte;
+			continue;
+		}
+		if (!(pp = pgtable_alloc())) {
+			tlb_gather_finish(&tg);
+			return -E_NO_MEM;
+		}
+		pp->pp_ref++;
+		child->env_pgdir[pdeno] = page2pa(pp) | PTE_P | PTE_U | PTE_W;
+
+		spt = (pte_t *) KADDR(PTE_ADDR(parent->env_pgdir[pdeno]));
+		dpt = (pte_t *) page2kva(pp);
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if (PTE_IS_SWAP(pte = spt[pteno])) {
+				// Each copy is faulted in separately.
+				swap_dup(pte);
+				dpt[pteno] = pte;
+				pp->pp_ptcount++;
+				continue;
+			}
+			if (!(pte & PTE_P))
+				continue;
+			if (pte & (PTE_W | PTE_COW)) {
+				if (pte & PTE_W)
+					tlb_gather_add(&tg, (uintptr_t) PGADDR(pdeno, pteno, 0));
+				pte = (pte & ~PTE_W) | PTE_COW;
+				spt[pteno] = pte;
+			}
+			if (pa2page(PTE_ADDR(pte)) == zero_page
+			    && zero_page->pp_ref >= ZERO_PAGE_MAXREF) {
+				tlb_gather_finish(&tg);
+				return -E_NO_MEM;
+			}
+			// Take the reference first, so that the page can't be
+			// swapped out if rmap_add has to allocate.
+			pa2page(PTE_ADDR(pte))->pp_ref++;
+			if (rmap_add(pa2page(PTE_ADDR(pte)), &dpt[pteno]) < 0) {
+				pa2page(PTE_ADDR(pte))->pp_ref--;
+				tlb_gather_finish(&tg);
+				return -E_NO_MEM;
+			}
+			dpt[pteno] = pte;
+			pp->pp_ptcount++;
+		}
+	}
+
+	tlb_gather_finish(&tg);
+
+	memcpy(child->env_regions, parent->env_regions,
+	       sizeof(child->env_regions));
+	child->env_nregions = parent->env_nregions;
+	return 0;
+}
+
+// Give e a private copy of the shared 4MB copy-on-write page 'pp' at
+// 'va', writable with 'perm'.
+static int
+env_cow_fault_large(struct Env *e, uintptr_t va, struct PageInfo *pp, int perm)
+{
+	struct PageInfo *copy;
+	void *dst, *src;
+	int i, r;
+
+	if (!(copy = page_alloc_order(MAX_ORDER, ALLOC_HIGHMEM)))
+		return -E_NO_MEM;
+	for (i = 0; i < NPTENTRIES; i++) {
+		dst = kmap(copy + i);
+		src = kmap(pp + i);
+		memcpy(dst, src, PGSIZE);
+		kunmap(src);
+		kunmap(dst);
+	}
+	if ((r = page_insert_large(e->env_pgdir, copy, (void *) va, perm)) < 0) {
+		page_free_order(copy, MAX_ORDER);
+		return r;
+	}
+	return 0;
+}
+
+//
+// Handle a write to copy-on-write page 'va' in environment e.  If e holds
+// the only reference left, the page simply becomes writable again;
+// otherwise e gets a private, writable copy.  A 4MB page is copied whole,
+// and the zero page is replaced by a freshly zeroed page.
+//
+// Returns 0 on success, -E_FAULT if 'va' is not a copy-on-write page,
+// -E_NO_MEM if out of memory.
+//
+int
+env_cow_fault(struct Env *e, uintptr_t va)
+{
+	struct PageInfo *pp, *copy;
+	void *dst, *src;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(pp = page_lookup(e->env_pgdir, (void *) va, &pte))
+	    || !(*pte & PTE_COW))
+		return -E_FAULT;
+	perm = (*pte & PTE_SYSCALL & ~(PTE_COW | PTE_P)) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		*pte = PTE_ADDR(*pte) | (*pte & PTE_PS) | perm | PTE_P;
+		tlb_invalidate(e->env_pgdir, (void *) va);
+		return 0;
+	}
+	if (*pte & PTE_PS)
+		return env_cow_fault_large(e, ROUNDDOWN(va, PTSIZE), pp, perm);
+
+	// Hold a reference to pp while it is copied, so that allocating
+	// the copy can't swap it out.
+	pp->pp_ref++;
+	if (!(copy = page_alloc(ALLOC_HIGHMEM
+				| (pp == zero_page ? ALLOC_ZERO : 0)))) {
+		page_decref(pp);
+		return -E_NO_MEM;
+	}
+	if (pp != zero_page) {
+		dst = kmap(copy);
+		src = kmap(pp);
+		memcpy(dst, src, PGSIZE);
+		kunmap(src);
+		kunmap(dst);
+	}
+	if ((r = page_insert(e->env_pgdir, copy, (void *) va, perm)) < 0)
+		page_free(copy);
+	page_decref(pp);
+	return r;
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -318,6 +571,10 @@ region_alloc(struct Env *e, void *va, size_t len)
 //
 // Finally, this function maps one page for the program's initial stack.
 //
+// Only pages holding data from the file are allocated up front.  The
+// rest of each segment (the bss) and the stack page are recorded as
+// demand-zero regions, which page_fault_handler fills on first touch.
+//
 // load_icode panics if it encounters problems.
 //  - How might load_icode fail?  What might be wrong with the given input?
 //
@@ -353,8 +610,9 @@ load_icode(struct Env *e, uint8_t *binary)
 	//  What?  (See env_run() and env_pop_tf() below.)
 
 	// LAB 3: Your code here.
-    lcr3(PADDR(e->env_pgdir));
-
+    // The segments are written through copy_to_user rather than with
+    // e's page directory loaded: loading a large program can swap out
+    // pages of it that are already loaded.
     struct Elf* elfhdr = (struct Elf*) binary;
 
     if (elfhdr->e_magic != ELF_MAGIC) {
@@ -367,22 +625,37 @@ load_icode(struct Env *e, uint8_t *binary)
     // for each section in the elf
 	for (; ph < eph; ph++) {
         if (ph->p_type == ELF_PROG_LOAD) {
-            // allocate pages
-            region_alloc(e, (void*)ph->p_va, ph->p_memsz);
-            // copy stuff
-            memcpy((void*)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-            // zero the rest
-            memset((void*)ph->p_va + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+            uintptr_t file_end = ph->p_va + ph->p_filesz;
+            uintptr_t mem_end = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+            uintptr_t lazy_start = ROUNDDOWN(ph->p_va, PGSIZE);
+            if (ph->p_filesz > 0) {
+                // allocate the pages backed by the file
+                region_alloc(e, (void*)ph->p_va, ph->p_filesz);
+                // copy stuff
+                if (copy_to_user(e, (void*)ph->p_va, binary + ph->p_offset, ph->p_filesz) < 0) {
+                    panic("cannot load segment at %08x", ph->p_va);
+                }
+                // zero the rest of the last file page
+                lazy_start = ROUNDUP(file_end, PGSIZE);
+                if (clear_user(e, (void*)file_end, lazy_start - file_end) < 0) {
+                    panic("cannot load segment at %08x", ph->p_va);
+                }
+            }
+            // the remaining pages are zero until touched
+            if (env_region_add(e, lazy_start, MAX(lazy_start, mem_end), PTE_U | PTE_W) < 0) {
+                panic("too many loadable segments");
+            }
         }
     }
-    lcr3(PADDR(kern_pgdir));
 
 	// Now map one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
 
 	// LAB 3: Your code here.
-    // allocate stack
-    region_alloc(e, (void*)(USTACKTOP - PGSIZE), PGSIZE);
+    // allocate stack on first touch
+    if (env_region_add(e, USTACKTOP - PGSIZE, USTACKTOP, PTE_U | PTE_W) < 0) {
+        panic("too many loadable segments");
+    }
     // TODO also load flags and stuff?
     e->env_tf.tf_esp = USTACKTOP;
     // Tank, start the jump program.
@@ -417,8 +690,6 @@ env_create(uint8_t *binary, enum EnvType type)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
 	physaddr_t pa;
 
 	// If freeing the current environment, switch to kern_pgdir
@@ -430,28 +701,10 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// which frees the page tables too
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
-	}
+	page_remove_range(e->env_pgdir, 0, UTOP);
 
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
@@ -459,6 +712,10 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
+	if (e->env_dl_period)
+		sched_setattr(e, 0, 0, 0);
+	sched_dequeue(e);
+	env_nlive--;
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
@@ -466,15 +723,26 @@ env_free(struct Env *e)
 
 //
 // Frees environment e.
+// If e was the current env, then runs a new environment (and does not
+// return to the caller).
 //
 void
 env_destroy(struct Env *e)
 {
+	// If e is currently running on other CPUs, we change its state to
+	// ENV_DYING. A zombie environment will be freed the next time
+	// it traps to the kernel.
+	if (e->env_status == ENV_RUNNING && curenv != e) {
+		e->env_status = ENV_DYING;
+		return;
+	}
+
 	env_free(e);
 
-	cprintf("Destroyed the only environment - nothing more to do!\n");
-	while (1)
-		monitor(NULL);
+	if (curenv == e) {
+		curenv = NULL;
+		sched_yield();
+	}
 }
 
 
@@ -524,15 +792,23 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-    if (curenv && curenv->env_status == ENV_RUNNING) {
+    if (curenv) {
+        curenv->env_runtime += read_tsc() - curenv->env_stamp;
+    }
+    if (curenv && curenv != e && curenv->env_status == ENV_RUNNING) {
         curenv->env_status = ENV_RUNNABLE;
+        sched_enqueue(curenv);
     }
 
+    sched_dequeue(e);
+    e->env_cpu = cpunum();
     curenv = e;
     e->env_status = ENV_RUNNING;
     e->env_runs += 1;
+    e->env_stamp = read_tsc();
     lcr3(PADDR(e->env_pgdir));
 
+    unlock_kernel();
     env_pop_tf(&e->env_tf);
 }
 
@@ -4,9 +4,11 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;		// Current environment
+#define curenv (thiscpu->cpu_env)	// Current environment
+extern int env_nlive;			// Environments not ENV_FREE
 extern struct Segdesc gdt[];
 
 void	env_init(void);
@@ -17,6 +19,10 @@ void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	env_region_add(struct Env *e, uintptr_t start, uintptr_t end, int perm);
+int	env_demand_page(struct Env *e, uintptr_t va, bool write);
+int	env_cow_clone(struct Env *child, struct Env *parent);
+int	env_cow_fault(struct Env *e, uintptr_t va);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -0,0 +1,116 @@
+/* See COPYRIGHT for copyright information. */
+
+// Minimal PIO-based (non-interrupt-driven) IDE driver for the primary
+// channel, after the one boot/main.c uses to load the kernel.
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/ide.h>
+
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_ERR		0x01
+
+#define IDE_CMD_READ	0x20
+#define IDE_CMD_WRITE	0x30
+#define IDE_CMD_IDENTIFY 0xEC
+
+// Wait for the controller to go idle.  Returns -1 if the last command
+// failed.
+static int
+ide_wait_ready(bool check_error)
+{
+	int r;
+
+	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+		/* do nothing */;
+
+	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
+		return -1;
+	return 0;
+}
+
+// Select disk 'diskno' and set up a transfer of 'nsecs' sectors starting
+// at 'secno', in 28-bit LBA mode.
+static void
+ide_select(int diskno, uint32_t secno, size_t nsecs)
+{
+	assert(nsecs <= 256);
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
+}
+
+//
+// Returns the number of sectors disk 'diskno' holds, or 0 if there is
+// no such disk.  A missing disk reads back an all-zero status, so this
+// must be called, and return non-zero, before the disk is otherwise
+// used: ide_read and ide_write would wait for it forever.
+//
+uint32_t
+ide_disk_size(int diskno)
+{
+	uint16_t id[256];
+	int i, r;
+
+	outb(0x1F6, 0xE0 | ((diskno & 1) << 4));
+	outb(0x1F7, IDE_CMD_IDENTIFY);
+
+	// Give the drive a moment to raise BSY or DRDY.
+	for (i = 0; i < 1000 && (r = inb(0x1F7)) == 0; i++)
+		/* do nothing */;
+	if (r == 0 || r == 0xFF)
+		return 0;
+	if (ide_wait_ready(1) < 0)
+		return 0;
+
+	insw(0x1F0, id, 256);
+	// Words 60-61: sectors addressable in 28-bit LBA mode.
+	return id[60] | ((uint32_t) id[61] << 16);
+}
+
+//
+// Read 'nsecs' sectors starting at sector 'secno' of disk 'diskno'
+// into 'dst'.
+// Returns 0 on success, -E_IO if the disk reports an error.
+//
+int
+ide_read(int diskno, uint32_t secno, void *dst, size_t nsecs)
+{
+	ide_wait_ready(0);
+	ide_select(diskno, secno, nsecs);
+	outb(0x1F7, IDE_CMD_READ);
+
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+		if (ide_wait_ready(1) < 0)
+			return -E_IO;
+		insl(0x1F0, dst, SECTSIZE / 4);
+	}
+	return 0;
+}
+
+//
+// Write 'nsecs' sectors from 'src' to disk 'diskno', starting at sector
+// 'secno'.
+// Returns 0 on success, -E_IO if the disk reports an error.
+//
+int
+ide_write(int diskno, uint32_t secno, const void *src, size_t nsecs)
+{
+	ide_wait_ready(0);
+	ide_select(diskno, secno, nsecs);
+	outb(0x1F7, IDE_CMD_WRITE);
+
+	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+		if (ide_wait_ready(1) < 0)
+			return -E_IO;
+		outsl(0x1F0, src, SECTSIZE / 4);
+	}
+	// Wait for the last sector to reach the disk.
+	return ide_wait_ready(1) < 0 ? -E_IO : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define SECTSIZE	512	// bytes per disk sector
+
+// A polling PIO driver for the disks on the primary IDE channel.
+// Disk 0 holds the kernel; the kernel uses disk 1 for swap space.
+
+uint32_t ide_disk_size(int diskno);
+int	ide_read(int diskno, uint32_t secno, void *dst, size_t nsecs);
+int	ide_write(int diskno, uint32_t secno, const void *src, size_t nsecs);
+
+#endif	// !JOS_KERN_IDE_H
@@ -3,8 +3,11 @@
 /* Support for reading the NVRAM from the real-time clock. */
 
 #include <inc/x86.h>
+#include <inc/trap.h>
 
 #include <kern/kclock.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
 
 
 unsigned
@@ -20,3 +23,17 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// Start the 8253 timer interrupting HZ times a second, and unmask its
+// IRQ.  pic_init must have been called.  With local APICs, each CPU's
+// APIC timer interrupts it instead (see lapic_init).
+void
+kclock_init(void)
+{
+	if (lapicaddr)
+		return;
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
+	outb(IO_TIMER1, TIMER_DIV(HZ) % 256);
+	outb(IO_TIMER1, TIMER_DIV(HZ) / 256);
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_TIMER));
+}
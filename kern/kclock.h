@@ -26,7 +26,29 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+// The 8253 programmable interval timer, which drives IRQ_TIMER.
+#define	IO_TIMER1	0x040		/* 8253 Timer #1 */
+#define	TIMER_FREQ	1193182		/* input clock, in Hz */
+#define	TIMER_DIV(x)	((TIMER_FREQ+(x)/2)/(x))
+#define	TIMER_MODE	(IO_TIMER1 + 3)	/* timer mode port */
+#define	TIMER_SEL0	0x00		/* select counter 0 */
+#define	TIMER_SEL2	0x80		/* select counter 2 */
+#define	TIMER_INTTC	0x00		/* mode 0, intr on terminal cnt */
+#define	TIMER_RATEGEN	0x04		/* mode 2, rate generator */
+#define	TIMER_16BIT	0x30		/* r/w counter 16 bits, LSB first */
+#define	TIMER_CNTR2	(IO_TIMER1 + 2)	/* timer counter 2 port */
+
+// Port B of the keyboard controller gates 8253 counter 2 and shows its
+// output.
+#define	IO_PPI		0x061
+#define	PPI_GATE2	0x01		/* counter 2 gate */
+#define	PPI_SPKR	0x02		/* counter 2 output to speaker */
+#define	PPI_OUT2	0x20		/* counter 2 output, read-only */
+
+#define	HZ		100		/* timer interrupts per second */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+void kclock_init(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
@@ -0,0 +1,701 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab allocator (see kern/kmem.h), after Bonwick, "The Slab Allocator:
+// An Object-Caching Kernel Memory Allocator", USENIX Summer 1994.
+//
+// A slab is a naturally aligned block of 2^order pages from the page
+// allocator.  It begins with a struct kmem_slab header, followed by one
+// free-list link per object, followed by the objects themselves.  Since
+// the slab is aligned to its size, the header of the slab holding any
+// object is found by rounding the object's address down.
+//
+// Free objects are chained by index through the header's link array
+// rather than through the objects, so freeing an object does not
+// clobber the state its constructor set up.
+//
+// Every page of a slab points back to it through pp_slab, which is how
+// kfree finds the cache an object came from.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_MAX_ORDER	3		// Largest slab is 2^3 pages
+#define KMEM_LINK_END	0xFFFF		// End of a slab's free list
+#define KMEM_LINK_USED	0xFFFE		// Marks an allocated object
+
+struct kmem_slab {
+	struct kmem_cache *cache;	// Cache this slab belongs to
+	struct kmem_slab *next;		// Links on one of the cache's
+	struct kmem_slab *prev;		// slab lists
+	char *objs;			// First object
+	uint16_t inuse;			// Objects allocated from this slab
+	uint16_t free;			// Index of first free object
+	uint16_t link[];		// Next free object, per object
+};
+
+// Slab lists.  Allocations come from partially used slabs first, so that
+// free objects are packed into as few slabs as possible.
+enum {
+	SLAB_PARTIAL,
+	SLAB_FULL,
+	SLAB_EMPTY,
+	NSLABLISTS
+};
+
+struct kmem_cache {
+	const char *name;
+	size_t size;			// Object size, rounded up to align
+	size_t align;			// Object alignment
+	int order;			// Each slab is 2^order pages
+	int objs_per_slab;
+	void (*ctor)(void *obj);
+	struct kmem_slab *slabs[NSLABLISTS];
+	struct spinlock lock;		// Protects everything below
+	int nslabs;			// Slabs on all three lists
+	int nempty;			// Slabs on slabs[SLAB_EMPTY]
+	uint32_t inuse;			// Objects allocated
+	uint32_t allocs;		// Total kmem_cache_alloc calls
+	struct kmem_cache *next;	// Link on kmem_caches
+};
+
+// Empty slabs a cache keeps for reuse before giving pages back.
+#define KMEM_MAX_EMPTY	1
+
+// Caches are themselves allocated from kmem_cache_cache.
+static struct kmem_cache kmem_cache_cache;
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = { 0, "kmem_caches_lock", -1 };
+
+// kmalloc size classes: KMALLOC_MIN << i bytes for kmalloc_caches[i]
+#define NKMALLOC	9
+
+static struct kmem_cache *kmalloc_caches[NKMALLOC];
+static const char *const kmalloc_names[NKMALLOC] = {
+	"kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+static struct {
+	uint32_t allocs;	// Successful kmalloc calls
+	uint32_t failed;	// kmalloc calls that ran out of memory
+	uint64_t requested;	// Bytes asked for by successful calls
+	uint64_t granted;	// Bytes set aside for them
+	uint32_t large;		// Large allocations in use
+	uint32_t large_pages;	// Pages they hold
+} kmalloc_stats;
+
+#ifdef KMALLOC_DEBUG
+// A debug allocation starts with a header recording its size, and the
+// rest of its object after the caller's bytes is a red zone.
+#define KMALLOC_MAGIC	0x6b6d616c	// "kmal"
+#define KMALLOC_REDZONE	8		// Smallest trailing red zone
+#define KMALLOC_RZ_BYTE	0xbb
+#define KMALLOC_POISON	0x6b		// Fills freed objects
+
+struct kmalloc_hdr {
+	uint32_t size;
+	uint32_t magic;
+};
+
+#define KMALLOC_OVERHEAD	(sizeof(struct kmalloc_hdr) + KMALLOC_REDZONE)
+#else
+#define KMALLOC_OVERHEAD	0
+#endif
+
+static void check_kmem(void);
+static void check_kmalloc(void);
+
+static void
+slab_list_push(struct kmem_cache *cp, struct kmem_slab *sp, int list)
+{
+	sp->prev = NULL;
+	sp->next = cp->slabs[list];
+	if (sp->next)
+		sp->next->prev = sp;
+	cp->slabs[list] = sp;
+}
+
+static void
+slab_list_remove(struct kmem_cache *cp, struct kmem_slab *sp, int list)
+{
+	if (sp->prev)
+		sp->prev->next = sp->next;
+	else
+		cp->slabs[list] = sp->next;
+	if (sp->next)
+		sp->next->prev = sp->prev;
+	sp->next = sp->prev = NULL;
+}
+
+// Bytes taken by the header of a slab holding 'n' objects, rounded up
+// so that the first object is aligned.
+static size_t
+slab_header_size(int n, size_t align)
+{
+	return ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t), align);
+}
+
+// Number of objects of 'size' bytes that fit in a slab of 'slabsize'.
+static int
+slab_capacity(size_t slabsize, size_t size, size_t align)
+{
+	int n = slabsize / size;
+
+	while (n > 0 && slab_header_size(n, align) + n * size > slabsize)
+		n--;
+	return n;
+}
+
+// Fill in the geometry of 'cp' for objects of 'size' bytes.
+// Returns 0 on success, -1 if an object does not fit in a slab.
+static int
+kmem_cache_init(struct kmem_cache *cp, const char *name, size_t size,
+		size_t align, void (*ctor)(void *obj))
+{
+	size_t slabsize;
+	int n, order;
+
+	// By default, align objects to the smallest power of two that
+	// holds them, up to a cache line, so that no object straddles
+	// more cache lines than it has to.
+	if (align == 0)
+		for (align = sizeof(void *); align < size && align < CACHELINE; )
+			align <<= 1;
+	if (align & (align - 1))
+		panic("kmem_cache_create %s: alignment %u not a power of two",
+		      name, align);
+
+	memset(cp, 0, sizeof(*cp));
+	cp->name = name;
+	cp->align = align;
+	cp->size = ROUNDUP(MAX(size, sizeof(void *)), align);
+	cp->ctor = ctor;
+	__spin_initlock(&cp->lock, name);
+
+	// Use the smallest slab that wastes at most 1/8 of its space.
+	for (order = 0; order <= KMEM_MAX_ORDER; order++) {
+		slabsize = PGSIZE << order;
+		n = slab_capacity(slabsize, cp->size, align);
+		if (n > 0 && (slabsize - n * cp->size) * 8 <= slabsize)
+			break;
+	}
+	if (order > KMEM_MAX_ORDER) {
+		order = KMEM_MAX_ORDER;
+		n = slab_capacity(PGSIZE << order, cp->size, align);
+	}
+	if (n <= 0)
+		return -1;
+	if (n > KMEM_LINK_USED)
+		n = KMEM_LINK_USED;
+	cp->order = order;
+	cp->objs_per_slab = n;
+	return 0;
+}
+
+static void kmalloc_init(void);
+
+//
+// Set up the slab allocator and kmalloc.  Must be called after mem_init.
+//
+void
+kmem_init(void)
+{
+	if (kmem_cache_init(&kmem_cache_cache, "kmem_cache",
+			    sizeof(struct kmem_cache), 0, NULL) < 0)
+		panic("kmem_init: cannot size kmem_cache_cache");
+	kmem_caches = &kmem_cache_cache;
+
+	check_kmem();
+	kmalloc_init();
+	check_kmalloc();
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' bytes
+// (a power of two, or 0 for a sensible default).  If 'ctor' is not NULL,
+// it is called on every object when its slab is first allocated.
+// 'name' is only used for statistics and must stay valid.
+//
+// Returns NULL if out of memory or if objects of this size do not fit
+// in a slab.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj))
+{
+	struct kmem_cache *cp;
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	if (kmem_cache_init(cp, name, size, align, ctor) < 0) {
+		kmem_cache_free(&kmem_cache_cache, cp);
+		return NULL;
+	}
+
+	spin_lock(&kmem_caches_lock);
+	cp->next = kmem_caches;
+	kmem_caches = cp;
+	spin_unlock(&kmem_caches_lock);
+	return cp;
+}
+
+// Give a slab's pages back to the page allocator.
+static void
+slab_destroy(struct kmem_cache *cp, struct kmem_slab *sp)
+{
+	struct PageInfo *pp = pa2page(PADDR(sp));
+	int i;
+
+	for (i = 0; i < (1 << cp->order); i++)
+		pp[i].pp_slab = NULL;
+	cp->nslabs--;
+	if (cp->order == 0)
+		page_free(pp);
+	else
+		page_free_order(pp, cp->order);
+}
+
+//
+// Destroy a cache.  All of its objects must have been freed.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_cache **cpp;
+	struct kmem_slab *sp;
+
+	if (cp->inuse)
+		panic("kmem_cache_destroy %s: %u objects still in use",
+		      cp->name, cp->inuse);
+
+	spin_lock(&kmem_caches_lock);
+	for (cpp = &kmem_caches; *cpp != cp; cpp = &(*cpp)->next)
+		assert(*cpp);
+	*cpp = cp->next;
+	spin_unlock(&kmem_caches_lock);
+
+	while ((sp = cp->slabs[SLAB_EMPTY])) {
+		slab_list_remove(cp, sp, SLAB_EMPTY);
+		slab_destroy(cp, sp);
+	}
+	kmem_cache_free(&kmem_cache_cache, cp);
+}
+
+// Allocate and construct a new slab for 'cp'.  Returns NULL if out of
+// memory.
+static struct kmem_slab *
+slab_create(struct kmem_cache *cp)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *sp;
+	int i;
+
+	if (cp->order == 0)
+		pp = page_alloc(0);
+	else
+		pp = page_alloc_order(cp->order, 0);
+	if (!pp)
+		return NULL;
+
+	for (i = 0; i < (1 << cp->order); i++)
+		pp[i].pp_slab = page2kva(pp);
+	sp = page2kva(pp);
+	sp->cache = cp;
+	sp->next = sp->prev = NULL;
+	sp->objs = (char *) sp + slab_header_size(cp->objs_per_slab, cp->align);
+	sp->inuse = 0;
+	sp->free = 0;
+	for (i = 0; i < cp->objs_per_slab; i++) {
+		sp->link[i] = i + 1 < cp->objs_per_slab ? i + 1 : KMEM_LINK_END;
+		if (cp->ctor)
+			cp->ctor(sp->objs + i * cp->size);
+	}
+	return sp;
+}
+
+//
+// Allocate an object from 'cp'.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+	int list, i;
+
+	spin_lock(&cp->lock);
+	if ((sp = cp->slabs[SLAB_PARTIAL]))
+		list = SLAB_PARTIAL;
+	else if ((sp = cp->slabs[SLAB_EMPTY])) {
+		list = SLAB_EMPTY;
+		cp->nempty--;
+	} else {
+		// page_alloc may free objects back to this cache while it
+		// reclaims memory for the new slab, so it runs unlocked.
+		spin_unlock(&cp->lock);
+		sp = slab_create(cp);
+		spin_lock(&cp->lock);
+		if (!sp) {
+			spin_unlock(&cp->lock);
+			return NULL;
+		}
+		cp->nslabs++;
+		list = -1;
+	}
+	if (list >= 0)
+		slab_list_remove(cp, sp, list);
+
+	i = sp->free;
+	sp->free = sp->link[i];
+	sp->link[i] = KMEM_LINK_USED;
+	sp->inuse++;
+	slab_list_push(cp, sp, sp->free == KMEM_LINK_END ? SLAB_FULL : SLAB_PARTIAL);
+
+	cp->inuse++;
+	cp->allocs++;
+	spin_unlock(&cp->lock);
+	return sp->objs + i * cp->size;
+}
+
+//
+// Return 'obj', allocated from 'cp', to the cache.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_slab *sp;
+	uint32_t off;
+	int i;
+
+	sp = ROUNDDOWN(obj, PGSIZE << cp->order);
+	if (sp->cache != cp)
+		panic("kmem_cache_free %s: %08x not from this cache",
+		      cp->name, obj);
+	off = (char *) obj - sp->objs;
+	i = off / cp->size;
+	if ((char *) obj < sp->objs || off % cp->size != 0
+	    || i >= cp->objs_per_slab)
+		panic("kmem_cache_free %s: bad object %08x", cp->name, obj);
+
+	spin_lock(&cp->lock);
+	if (sp->link[i] != KMEM_LINK_USED)
+		panic("kmem_cache_free %s: %08x already free", cp->name, obj);
+	slab_list_remove(cp, sp, sp->free == KMEM_LINK_END ? SLAB_FULL : SLAB_PARTIAL);
+	sp->link[i] = sp->free;
+	sp->free = i;
+	sp->inuse--;
+	cp->inuse--;
+
+	if (sp->inuse > 0)
+		slab_list_push(cp, sp, SLAB_PARTIAL);
+	else if (cp->nempty < KMEM_MAX_EMPTY) {
+		slab_list_push(cp, sp, SLAB_EMPTY);
+		cp->nempty++;
+	} else
+		slab_destroy(cp, sp);
+	spin_unlock(&cp->lock);
+}
+
+//
+// Print per-cache statistics.
+//
+void
+kmem_print_stats(void)
+{
+	struct kmem_cache *cp;
+	uint32_t total;
+
+	cprintf("%-16s %6s %5s %5s %7s %7s %7s %5s\n", "cache", "size",
+		"align", "pages", "inuse", "free", "allocs", "slabs");
+	spin_lock(&kmem_caches_lock);
+	for (cp = kmem_caches; cp; cp = cp->next) {
+		total = cp->nslabs * cp->objs_per_slab;
+		cprintf("%-16s %6u %5u %5u %7u %7u %7u %5u\n", cp->name,
+			cp->size, cp->align, 1 << cp->order, cp->inuse,
+			total - cp->inuse, cp->allocs, cp->nslabs);
+	}
+	spin_unlock(&kmem_caches_lock);
+
+	cprintf("kmalloc: %u allocs, %u failed, %llu bytes requested, "
+		"%llu granted\n", kmalloc_stats.allocs, kmalloc_stats.failed,
+		kmalloc_stats.requested, kmalloc_stats.granted);
+	cprintf("kmalloc: %u large allocations in use, %u pages\n",
+		kmalloc_stats.large, kmalloc_stats.large_pages);
+}
+
+
+// --------------------------------------------------------------
+// kmalloc.
+// --------------------------------------------------------------
+
+static void
+kmalloc_init(void)
+{
+	int i;
+
+	for (i = 0; i < NKMALLOC; i++)
+		if (!(kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+							    KMALLOC_MIN << i,
+							    0, NULL)))
+			panic("kmalloc_init: cannot create %s", kmalloc_names[i]);
+}
+
+// Returns the index of the smallest size class that holds 'size' bytes.
+static int
+kmalloc_class(size_t size)
+{
+	int i;
+
+	for (i = 0; (KMALLOC_MIN << i) < size; i++)
+		/* do nothing */;
+	return i;
+}
+
+#ifdef KMALLOC_DEBUG
+// Fill in the header and red zone of a new allocation of 'size' bytes in
+// an object of 'objsize' bytes at 'obj'.  Returns the caller's pointer.
+static void *
+kmalloc_debug_init(char *obj, size_t objsize, size_t size)
+{
+	struct kmalloc_hdr *hdr = (struct kmalloc_hdr *) obj;
+
+	hdr->size = size;
+	hdr->magic = KMALLOC_MAGIC;
+	memset(obj + sizeof(*hdr) + size, KMALLOC_RZ_BYTE,
+	       objsize - sizeof(*hdr) - size);
+	return obj + sizeof(*hdr);
+}
+
+// Check the red zones of the allocation at 'ptr' in an object of
+// 'objsize' bytes, and poison it.  Returns the object's address.
+static void *
+kmalloc_debug_check(char *ptr, size_t objsize)
+{
+	struct kmalloc_hdr *hdr = (struct kmalloc_hdr *) ptr - 1;
+	char *p, *end = (char *) hdr + objsize;
+
+	if (hdr->magic != KMALLOC_MAGIC
+	    || hdr->size > objsize - KMALLOC_OVERHEAD)
+		panic("kfree: red zone before %08x overwritten", ptr);
+	for (p = ptr + hdr->size; p < end; p++)
+		if (*p != (char) KMALLOC_RZ_BYTE)
+			panic("kfree: red zone after %08x (%u bytes) "
+			      "overwritten at +%u", ptr, hdr->size, p - ptr);
+	memset(hdr, KMALLOC_POISON, objsize);
+	return hdr;
+}
+#endif
+
+//
+// Allocate 'size' bytes of kernel memory.  Requests of up to KMALLOC_MAX
+// bytes come from the smallest size class that fits, and are aligned to
+// the smaller of their class size and CACHELINE (8 bytes in a
+// KMALLOC_DEBUG kernel).  Larger requests get whole pages: the smallest
+// naturally aligned block of 2^order pages that holds them.
+//
+// Returns NULL if out of memory, or if size is 0.
+//
+void *
+kmalloc(size_t size)
+{
+	struct PageInfo *pp;
+	struct kmem_cache *cp;
+	char *obj;
+	int order;
+
+	if (size == 0)
+		return NULL;
+
+	if (size <= KMALLOC_MAX - KMALLOC_OVERHEAD) {
+		cp = kmalloc_caches[kmalloc_class(size + KMALLOC_OVERHEAD)];
+		if (!(obj = kmem_cache_alloc(cp)))
+			goto fail;
+		kmalloc_stats.allocs++;
+		kmalloc_stats.requested += size;
+		kmalloc_stats.granted += cp->size;
+#ifdef KMALLOC_DEBUG
+		obj = kmalloc_debug_init(obj, cp->size, size);
+#endif
+		return obj;
+	}
+
+	for (order = 0; order <= MAX_ORDER && (PGSIZE << order) < size; order++)
+		/* do nothing */;
+	if (order > MAX_ORDER || !(pp = page_alloc_order(order, 0)))
+		goto fail;
+	pp->pp_flags |= PP_KMALLOC;
+	pp->pp_order = order;
+	kmalloc_stats.allocs++;
+	kmalloc_stats.requested += size;
+	kmalloc_stats.granted += PGSIZE << order;
+	kmalloc_stats.large++;
+	kmalloc_stats.large_pages += 1 << order;
+	return page2kva(pp);
+
+fail:
+	kmalloc_stats.failed++;
+	return NULL;
+}
+
+//
+// Free memory allocated by kmalloc.  Does nothing if 'ptr' is NULL.
+//
+void
+kfree(void *ptr)
+{
+	struct PageInfo *pp;
+	struct kmem_cache *cp;
+	int i;
+
+	if (!ptr)
+		return;
+
+	pp = pa2page(PADDR(ptr));
+	if (pp->pp_flags & PP_KMALLOC) {
+		if (page2kva(pp) != ptr)
+			panic("kfree: %08x is inside a large allocation", ptr);
+		pp->pp_flags &= ~PP_KMALLOC;
+		kmalloc_stats.large--;
+		kmalloc_stats.large_pages -= 1 << pp->pp_order;
+		page_free_order(pp, pp->pp_order);
+		return;
+	}
+
+	cp = pp->pp_slab ? pp->pp_slab->cache : NULL;
+	for (i = 0; i < NKMALLOC && kmalloc_caches[i] != cp; i++)
+		/* do nothing */;
+	if (!cp || i == NKMALLOC)
+		panic("kfree: %08x was not allocated by kmalloc", ptr);
+#ifdef KMALLOC_DEBUG
+	ptr = kmalloc_debug_check(ptr, cp->size);
+#endif
+	kmem_cache_free(cp, ptr);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static int check_kmem_ctor_calls;
+
+static void
+check_kmem_ctor(void *obj)
+{
+	memset(obj, 0x5a, 48);
+	check_kmem_ctor_calls++;
+}
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *cp, *big;
+	char *obj, *objs[600], *prev;
+	int i, n;
+
+	// objects are aligned and constructed once per slab
+	assert((cp = kmem_cache_create("check", 48, 0, check_kmem_ctor)));
+	assert(cp->size == 64 && cp->align == CACHELINE);
+	assert(cp->order == 0 && cp->objs_per_slab > 1);
+	n = cp->objs_per_slab;
+	assert((obj = kmem_cache_alloc(cp)));
+	assert(((uintptr_t) obj & (CACHELINE - 1)) == 0);
+	assert(check_kmem_ctor_calls == n);
+	for (i = 0; i < 48; i++)
+		assert(obj[i] == 0x5a);
+
+	// freed objects are reused, still constructed
+	kmem_cache_free(cp, obj);
+	assert(kmem_cache_alloc(cp) == obj);
+	assert(obj[0] == 0x5a);
+	kmem_cache_free(cp, obj);
+
+	// filling a slab creates a second one
+	for (i = 0; i < n + 1; i++) {
+		assert((objs[i] = kmem_cache_alloc(cp)));
+		assert(i == 0 || objs[i] != objs[i - 1]);
+	}
+	assert(cp->nslabs == 2 && cp->inuse == n + 1);
+	assert(check_kmem_ctor_calls == 2 * n);
+	for (i = 0; i < n + 1; i++)
+		kmem_cache_free(cp, objs[i]);
+	assert(cp->inuse == 0 && cp->nslabs == KMEM_MAX_EMPTY);
+
+	// large objects get multi-page slabs
+	assert((big = kmem_cache_create("check-big", 1500, 0, NULL)));
+	assert(big->order > 0 && big->align == CACHELINE);
+	for (i = 0, prev = NULL; i < big->objs_per_slab * 3; i++) {
+		assert((objs[i] = kmem_cache_alloc(big)));
+		assert(objs[i] != prev);
+		memset(objs[i], i, 1500);
+		prev = objs[i];
+	}
+	for (i = 0; i < big->objs_per_slab * 3; i++) {
+		assert(objs[i][0] == (char) i && objs[i][1499] == (char) i);
+		kmem_cache_free(big, objs[i]);
+	}
+
+	kmem_cache_destroy(big);
+	kmem_cache_destroy(cp);
+	assert(kmem_caches == &kmem_cache_cache);
+
+	cprintf("check_kmem() succeeded!\n");
+}
+
+static void
+check_kmalloc(void)
+{
+	char *p, *q, *objs[NKMALLOC];
+	struct PageInfo *pp;
+	size_t size;
+	int i;
+
+	// each size class serves the requests that fit it, and nothing
+	// smaller, and objects don't overlap
+	for (i = 0; i < NKMALLOC; i++) {
+		size = (KMALLOC_MIN << i) - KMALLOC_OVERHEAD;
+		if (size == 0 || size > KMALLOC_MAX)
+			size = 1;
+		assert((objs[i] = kmalloc(size)));
+		assert(pa2page(PADDR(objs[i]))->pp_slab->cache
+		       == kmalloc_caches[kmalloc_class(size + KMALLOC_OVERHEAD)]);
+		memset(objs[i], i, size);
+	}
+	for (i = 0; i < NKMALLOC; i++) {
+		size = (KMALLOC_MIN << i) - KMALLOC_OVERHEAD;
+		if (size == 0 || size > KMALLOC_MAX)
+			size = 1;
+		assert(objs[i][0] == i && objs[i][size - 1] == i);
+		kfree(objs[i]);
+	}
+	assert(kmalloc_class(KMALLOC_MIN + 1) == 1);
+	assert(!kmalloc(0));
+	kfree(NULL);
+
+	// a freed object is handed out again
+	assert((p = kmalloc(100)));
+	kfree(p);
+	assert((q = kmalloc(100)) == p);
+	kfree(q);
+
+	// large requests get whole, aligned pages
+	assert((p = kmalloc(3 * PGSIZE)));
+	pp = pa2page(PADDR(p));
+	assert(page2kva(pp) == p && (pp->pp_flags & PP_KMALLOC));
+	assert(pp->pp_order == 2 && (pp - pages) % 4 == 0);
+	assert(kmalloc_stats.large == 1 && kmalloc_stats.large_pages == 4);
+	memset(p, 0xcc, 3 * PGSIZE);
+	kfree(p);
+	assert(!(pp->pp_flags & PP_KMALLOC) && kmalloc_stats.large == 0);
+	assert((p = kmalloc(KMALLOC_MAX + 1)));
+	assert(pa2page(PADDR(p))->pp_order == 0);
+	kfree(p);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
@@ -0,0 +1,41 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Slab allocator for kernel objects smaller than a page.
+//
+// Objects of one type come from a cache created with kmem_cache_create.
+// Each cache carves slabs of one or more contiguous physical pages into
+// equally sized objects.  If the cache has a constructor, it runs once on
+// every object when its slab is created; objects should be freed back in
+// their constructed state, so a later kmem_cache_alloc can skip it.
+
+struct kmem_cache;
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *obj));
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void *	kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+void	kmem_print_stats(void);
+
+// General-purpose kernel heap.
+//
+// kmalloc serves requests of up to KMALLOC_MAX bytes from caches of
+// power-of-two sized objects, and larger ones with contiguous pages
+// from page_alloc_order.  The memory is always in lowmem.  A kernel
+// built with -DKMALLOC_DEBUG (e.g. make DEFS=-DKMALLOC_DEBUG) puts red
+// zones around small allocations and checks them in kfree.
+
+#define KMALLOC_MIN	8		// Smallest size class
+#define KMALLOC_MAX	2048		// Largest size class
+
+void *	kmalloc(size_t size);
+void	kfree(void *ptr);
+
+#endif	// !JOS_KERN_KMEM_H
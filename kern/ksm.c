@@ -0,0 +1,204 @@
+/* See COPYRIGHT for copyright information. */
+
+// Same-page merging (see kern/ksm.h).
+//
+// A cursor sweeps the pages array, KSM_SCAN_BATCH pages per ksm_scan
+// call.  Each candidate page is hashed and looked up in ksm_table, a
+// direct-mapped table from hash to the last page seen with that hash.
+// If that page still has the same contents, the two are merged;
+// otherwise the candidate takes its place in the table.  Entries are
+// never trusted: a page may have changed, been freed or been reused
+// since it was entered, so it is checked again and compared in full
+// before anything is merged.
+//
+// Only pages that could also be migrated or swapped out are candidates.
+// A page written since the cursor last passed it (PTE_D set in one of
+// its PTEs) is likely to be written again soon, so it is skipped this
+// time round, and its dirty bits are cleared for the next.
+//
+// Each ksm_scan call hashes at most KSM_SCAN_BATCH pages and merges at
+// most KSM_MERGE_BATCH, so it never takes long.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/ksm.h>
+#include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/rmap.h>
+
+#define KSM_TABLE_SIZE	1024	// Entries in ksm_table
+#define KSM_SCAN_BATCH	32	// Pages examined per ksm_scan call
+#define KSM_MERGE_BATCH	8	// Pages merged per ksm_scan call, at most
+
+static struct {
+	uint32_t hash;
+	struct PageInfo *pp;
+} ksm_table[KSM_TABLE_SIZE];
+
+static size_t ksm_cursor;	// Next page number to examine
+static uint32_t ksm_zero_hash;	// Hash of a page of zeroes
+uint32_t ksm_passes;		// Times the cursor has gone round
+
+static struct {
+	uint32_t scanned;	// Candidate pages hashed
+	uint32_t dirty;		// Candidates skipped as recently written
+	uint32_t merged;	// Pages merged into another and freed
+	uint32_t zero;		// ... of which into the zero page
+	uint32_t failed;	// Merges that ran out of memory
+} ksm_stats;
+
+// FNV-1a, a word at a time.
+static uint32_t
+ksm_hash(const void *page)
+{
+	const uint32_t *p = page;
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+void
+ksm_init(void)
+{
+	ksm_zero_hash = ksm_hash(page2kva(zero_page));
+}
+
+static int
+ksm_clean_pte(pte_t *ptep, void *arg)
+{
+	if (*ptep & PTE_D) {
+		*(bool *) arg = 1;
+		*ptep &= ~PTE_D;
+	}
+	return 0;
+}
+
+// Returns true if pages 'pp' and 'kp' have the same contents.
+static bool
+ksm_same(struct PageInfo *pp, struct PageInfo *kp)
+{
+	void *a, *b;
+	bool same;
+
+	a = kmap(pp);
+	b = kmap(kp);
+	same = memcmp(a, b, PGSIZE) == 0;
+	kunmap(b);
+	kunmap(a);
+	return same;
+}
+
+// Examine page 'pp', merging it if an identical page is known.  Sets
+// *flush if it cleared dirty bits.  Returns true if pp was merged.
+static bool
+ksm_scan_page(struct PageInfo *pp, bool *flush)
+{
+	struct PageInfo *kp = NULL;
+	bool dirty = 0, protected;
+	uint32_t h, i;
+	void *kva;
+
+	if (pp == zero_page || !page_movable(pp))
+		return 0;
+
+	rmap_walk(pp, ksm_clean_pte, &dirty);
+	if (dirty) {
+		ksm_stats.dirty++;
+		*flush = 1;
+		return 0;
+	}
+
+	kva = kmap(pp);
+	h = ksm_hash(kva);
+	kunmap(kva);
+	ksm_stats.scanned++;
+
+	i = h % KSM_TABLE_SIZE;
+	if (h == ksm_zero_hash)
+		kp = zero_page;
+	else if (ksm_table[i].hash == h && ksm_table[i].pp
+		 && ksm_table[i].pp != pp && page_movable(ksm_table[i].pp))
+		kp = ksm_table[i].pp;
+
+	if (!kp || kp->pp_ref + pp->pp_ref > ZERO_PAGE_MAXREF)
+		goto remember;
+
+	// Other CPUs run user code without the kernel lock, so a write to
+	// either page could land after the comparison and be lost in the
+	// merge.  Write-protect both, and flush them from every TLB, first.
+	protected = page_wrprotect(pp);
+	if (kp != zero_page)
+		protected |= page_wrprotect(kp);
+	if (protected)
+		tlb_flush_all();
+	if (!ksm_same(pp, kp))
+		goto remember;
+	if (page_merge(pp, kp) < 0) {
+		ksm_stats.failed++;
+		return 0;
+	}
+	// pp is free now: drop the read-only entries for it that other
+	// CPUs may have loaded since the flush, before it is reused.
+	tlb_flush_all();
+	ksm_stats.merged++;
+	ksm_stats.zero += kp == zero_page;
+	return 1;
+
+remember:
+	ksm_table[i].hash = h;
+	ksm_table[i].pp = pp;
+	return 0;
+}
+
+//
+// Examine the next few pages for ones to merge.  Called from the
+// kernel's idle loops.
+//
+// Returns the number of pages examined: 0 if scanning is off, because
+// there is no zero page or the kernel has panicked.
+//
+int
+ksm_scan(void)
+{
+	struct PageInfo *pp;
+	int scanned, merged = 0;
+	bool flush = 0;
+
+	if (!zero_page || panicstr)
+		return 0;
+	for (scanned = 0; scanned < KSM_SCAN_BATCH && merged < KSM_MERGE_BATCH;
+	     scanned++) {
+		pp = &pages[ksm_cursor];
+		if (++ksm_cursor == npages) {
+			ksm_cursor = 0;
+			ksm_passes++;
+		}
+		merged += ksm_scan_page(pp, &flush);
+	}
+
+	// Drop the TLB entries that would keep the CPUs from setting the
+	// dirty bits just cleared.
+	if (flush)
+		tlb_flush_all();
+	return scanned;
+}
+
+//
+// Print page merging statistics.
+//
+void
+ksm_print_stats(void)
+{
+	cprintf("Same-page merging: %u passes, %u pages hashed, "
+		"%u skipped as dirty\n",
+		ksm_passes, ksm_stats.scanned, ksm_stats.dirty);
+	cprintf("  %u pages merged (%u into the zero page), %u KB freed, "
+		"%u failed\n", ksm_stats.merged, ksm_stats.zero,
+		ksm_stats.merged * (PGSIZE / 1024), ksm_stats.failed);
+}
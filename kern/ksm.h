@@ -0,0 +1,21 @@
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Same-page merging: a scanner, run a little at a time from the kernel's
+// idle loops, that finds user pages with identical contents, in the same
+// environment or in different ones, and merges each set into one
+// copy-on-write page with page_merge.  Pages that are all zero merge
+// into the zero page.
+
+void	ksm_init(void);
+int	ksm_scan(void);
+void	ksm_print_stats(void);
+
+extern uint32_t ksm_passes;
+
+#endif	// !JOS_KERN_KSM_H
@@ -12,6 +12,10 @@
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
+#include <kern/kmem.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+#include <kern/sched.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -33,6 +37,15 @@ static struct Command commands[] = {
 	{ "pgmod", "Change permission of page mappings", mon_pgmod },
 	{ "memxv", "Examine a range of virtual memory", mon_memxv },
 	{ "memxp", "Examine a range of physical memory", mon_memxp },
+	{ "pagestat", "Display physical page allocator statistics", mon_pagestat },
+	{ "pagebench", "Benchmark the physical page allocator", mon_pagebench },
+	{ "compact", "Migrate pages to free contiguous blocks of 2^order pages", mon_compact },
+	{ "slabinfo", "Display slab allocator cache and kmalloc statistics", mon_slabinfo },
+	{ "swapstat", "Display swap space usage and paging statistics", mon_swapstat },
+	{ "ksm", "Display same-page merging statistics; optionally scan for N passes first", mon_ksm },
+	{ "tlbbench", "Benchmark address-space switches with and without global pages", mon_tlbbench },
+	{ "tlbstat", "Display TLB invalidation statistics; optionally set the full-flush threshold", mon_tlbstat },
+	{ "ps", "Display environments with their scheduling state and CPU time", mon_ps },
 	{ "exit", "Exit from the monitor", mon_exit },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -149,11 +162,17 @@ static void mon_showmappings_entry(void *va) {
             cprintf("%08p  -no-page-  U:- W:-\n", va);
         } else {
             // Page mapping found.
-            cprintf("%08p  %08p  U:%d W:%d\n",
+            physaddr_t pa = PTE_ADDR(pa_wflags);
+            if (pa_wflags & PTE_PS) {
+                // Part of a 4MB page.
+                pa = PDE_PS_ADDR(pa_wflags) + PTX(va) * PGSIZE;
+            }
+            cprintf("%08p  %08p  U:%d W:%d%s\n",
                 va,
-                PTE_ADDR(pa_wflags),
+                pa,
                 !!(pa_wflags & PTE_U),
-                !!(pa_wflags & PTE_W));
+                !!(pa_wflags & PTE_W),
+                (pa_wflags & PTE_PS) ? " 4M" : "");
         }
     }
 }
@@ -264,6 +283,9 @@ mon_pgmod(int argc, char **argv, struct Trapframe *tf)
         cprintf("%08p has no page.\n", va);
         return 0;
     }
+    if (pa_wflags & PTE_PS) {
+        cprintf("%08p is part of a 4MB page; changing all of it.\n", va);
+    }
     // Clear permissions bits.
     pa_wflags = pa_wflags & ~PTE_U & ~PTE_W;
     // Set permissions bits.
@@ -380,7 +402,10 @@ mon_memxp(int argc, char **argv, struct Trapframe *tf)
     uintptr_t pa = pa_lo;
     for (; pa <= pa_hi; pa += 4) {
         if (PGNUM(pa) < npages) {
-            cprintf("%08p  %08p\n", pa, *(uint32_t*)KADDR(pa));
+            // kmap reaches highmem, which has no KERNBASE address.
+            char *kva = kmap(pa2page(pa));
+            cprintf("%08p  %08p\n", pa, *(uint32_t*)(kva + PGOFF(pa)));
+            kunmap(kva);
         } else {
             cprintf("Address out of range.\n");
         }
@@ -389,6 +414,130 @@ mon_memxp(int argc, char **argv, struct Trapframe *tf)
     return 0;
 }
 
+int
+mon_pagestat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	return 0;
+}
+
+int
+mon_pagebench(int argc, char **argv, struct Trapframe *tf)
+{
+	page_bench();
+	return 0;
+}
+
+int
+mon_compact(int argc, char **argv, struct Trapframe *tf)
+{
+	uint64_t start, cycles;
+	int order = MAX_ORDER, blocks = 0, moved = 0, r;
+	char *end;
+
+	if (argc > 2) {
+		cprintf("Usage: compact [order]\n");
+		return 0;
+	}
+	if (argc == 2) {
+		order = strtol(argv[1], &end, 10);
+		if (end == argv[1] || *end || order < 1 || order > MAX_ORDER) {
+			cprintf("Error: order must be 1 to %d.\n", MAX_ORDER);
+			return 0;
+		}
+	}
+
+	// Each pass frees one more block without breaking up another,
+	// so this ends once no block left can be freed.
+	start = read_tsc();
+	while ((r = page_compact(order, ALLOC_HIGHMEM)) >= 0) {
+		blocks++;
+		moved += r;
+	}
+	cycles = read_tsc() - start;
+	cprintf("Freed %d blocks of order %d, moving %d pages, in %llu cycles\n",
+		blocks, order, moved, cycles);
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
+int
+mon_swapstat(int argc, char **argv, struct Trapframe *tf)
+{
+	swap_print_stats();
+	return 0;
+}
+
+int
+mon_ksm(int argc, char **argv, struct Trapframe *tf)
+{
+	uint32_t passes;
+	char *end;
+	long n = 0;
+
+	if (argc > 2) {
+		cprintf("Usage: ksm [passes]\n");
+		return 0;
+	}
+	if (argc == 2) {
+		n = strtol(argv[1], &end, 10);
+		if (end == argv[1] || *end || n < 0) {
+			cprintf("Error: passes must be a non-negative number.\n");
+			return 0;
+		}
+	}
+
+	for (passes = ksm_passes; ksm_passes - passes < n; )
+		if (ksm_scan() == 0) {
+			cprintf("Error: page merging is off.\n");
+			break;
+		}
+	ksm_print_stats();
+	return 0;
+}
+
+int
+mon_tlbbench(int argc, char **argv, struct Trapframe *tf)
+{
+	tlb_bench();
+	return 0;
+}
+
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf)
+{
+	char *end;
+	long n;
+
+	if (argc > 2) {
+		cprintf("Usage: tlbstat [threshold]\n");
+		return 0;
+	}
+	if (argc == 2) {
+		n = strtol(argv[1], &end, 10);
+		if (end == argv[1] || *end || n < 0 || n > TLB_GATHER_MAX) {
+			cprintf("Error: threshold must be 0 to %d.\n", TLB_GATHER_MAX);
+			return 0;
+		}
+		tlb_flush_threshold = n;
+	}
+	tlb_print_stats();
+	return 0;
+}
+
+int
+mon_ps(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_print_stats();
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -11,6 +11,9 @@ struct Trapframe;
 // (NULL if none).
 void monitor(struct Trapframe *tf);
 
+// The message of the first call to panic, or NULL (see kern/init.c).
+extern const char *panicstr;
+
 // Functions implementing monitor commands.
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
@@ -21,5 +24,14 @@ int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_pgmod(int argc, char **argv, struct Trapframe *tf);
 int mon_memxv(int argc, char **argv, struct Trapframe *tf);
 int mon_memxp(int argc, char **argv, struct Trapframe *tf);
+int mon_pagestat(int argc, char **argv, struct Trapframe *tf);
+int mon_pagebench(int argc, char **argv, struct Trapframe *tf);
+int mon_compact(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_swapstat(int argc, char **argv, struct Trapframe *tf);
+int mon_ksm(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbbench(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbstat(int argc, char **argv, struct Trapframe *tf);
+int mon_ps(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -0,0 +1,360 @@
+// Search for and parse the multiprocessor configuration table, or
+// failing that the ACPI MADT.
+// See http://developer.intel.com/design/pentium/datashts/24201606.pdf
+// and the ACPI specification, section 5.2.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ismp;
+int ncpu = 1;		// Until mp_init counts them
+
+// Per-CPU kernel stacks
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+__attribute__ ((aligned(PGSIZE)));
+
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
+
+// Table entry types
+#define MPPROC    0x00  // One per processor
+#define MPBUS     0x01  // One per bus
+#define MPIOAPIC  0x02  // One per I/O APIC
+#define MPIOINTR  0x03  // One per bus interrupt source
+#define MPLINTR   0x04  // One per system interrupt source
+
+// See the ACPI Specification, Version 2.0 or later
+
+struct acpi_rsdp {      // root system description pointer [ACPI 5.2.5]
+	uint8_t signature[8];           // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t revision;
+	physaddr_t rsdt;                // phys addr of the RSDT
+} __attribute__((__packed__));
+
+struct acpi_header {    // system description table header [ACPI 5.2.6]
+	uint8_t signature[4];
+	uint32_t length;                // total table length
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t oemtableid[8];
+	uint32_t oemrevision;
+	uint32_t creatorid;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct acpi_madt {      // multiple APIC description table [ACPI 5.2.12]
+	struct acpi_header header;      // "APIC"
+	physaddr_t lapicaddr;           // address of local APIC
+	uint32_t flags;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct acpi_madt_lapic { // processor local APIC entry [ACPI 5.2.12.2]
+	uint8_t type;                   // entry type (0)
+	uint8_t length;                 // 8
+	uint8_t acpiid;                 // ACPI processor id
+	uint8_t apicid;                 // local APIC id
+	uint32_t flags;                 // CPU flags
+} __attribute__((__packed__));
+
+// acpi_madt_lapic flags
+#define MADT_LAPIC_ENABLED 0x01         // This processor is usable
+
+// MADT entry types
+#define MADT_LAPIC  0x00                // One per processor
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *)addr)[i];
+	return sum;
+}
+
+// Look for a structure with a 'siglen'-byte signature 'sig' and a
+// 'len'-byte checksum, on a 16-byte boundary in the 'n' bytes at
+// physical address 'a'.
+static void *
+tablesearch1(physaddr_t a, int n, const char *sig, int siglen, int len)
+{
+	uint8_t *p = KADDR(a), *end = KADDR(a + n);
+
+	for (; p + len <= end; p += 16)
+		if (memcmp(p, sig, siglen) == 0 && sum(p, len) == 0)
+			return p;
+	return NULL;
+}
+
+// Search for a structure as tablesearch1 does, in the places where the
+// BIOS leaves both the MP floating pointer [MP 4] and the ACPI RSDP
+// [ACPI 5.2.5.1]:
+// 1) in the first KB of the EBDA;
+// 2) if there is no EBDA, in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xE0000 and 0xFFFFF.
+static void *
+tablesearch(const char *sig, int siglen, int len)
+{
+	uint8_t *bda;
+	uint32_t p;
+	void *t;
+
+	// The BIOS data area lives in 16-bit segment 0x40.
+	bda = (uint8_t *) KADDR(0x40 << 4);
+
+	// [MP 4] The 16-bit segment of the EBDA is in the two bytes
+	// starting at byte 0x0E of the BDA.  0 if not present.
+	if ((p = *(uint16_t *) (bda + 0x0E))) {
+		p <<= 4;	// Translate from segment to PA
+		if ((t = tablesearch1(p, 1024, sig, siglen, len)))
+			return t;
+	} else {
+		// The size of base memory, in KB is in the two bytes
+		// starting at 0x13 of the BDA.
+		p = *(uint16_t *) (bda + 0x13) * 1024;
+		if ((t = tablesearch1(p - 1024, 1024, sig, siglen, len)))
+			return t;
+	}
+	return tablesearch1(0xE0000, 0x20000, sig, siglen, len);
+}
+
+// Search for an MP configuration table.  For now, don't accept the
+// default configurations (physaddr == 0).
+// Check for the correct signature, checksum, and version.
+static struct mpconf *
+mpconfig(struct mp **pmp)
+{
+	struct mpconf *conf;
+	struct mp *mp;
+
+	static_assert(sizeof(*mp) == 16);
+	if ((mp = tablesearch("_MP_", 4, sizeof(*mp))) == 0)
+		return NULL;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return NULL;
+	}
+	conf = (struct mpconf *) KADDR(mp->physaddr);
+	if (memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return NULL;
+	}
+	if (sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return NULL;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return NULL;
+	}
+	if ((sum((uint8_t *)conf + conf->length, conf->xlength) + conf->xchecksum) & 0xff) {
+		cprintf("SMP: Bad MP configuration extended checksum\n");
+		return NULL;
+	}
+	*pmp = mp;
+	return conf;
+}
+
+// Record a processor with local APIC ID 'apicid'.  cpunum() takes a
+// CPU's APIC ID to be its index in cpus[], as it is in QEMU and on most
+// small machines, so a CPU for which that's not true can't be used.
+static void
+cpu_add(uint8_t apicid, bool boot)
+{
+	if (ncpu == NCPU) {
+		cprintf("SMP: too many CPUs, CPU %d disabled\n", apicid);
+		return;
+	}
+	if (apicid != ncpu) {
+		cprintf("SMP: APIC ID %d out of order, CPU disabled\n", apicid);
+		return;
+	}
+	if (boot)
+		bootcpu = &cpus[ncpu];
+	cpus[ncpu].cpu_id = ncpu;
+	cpus[ncpu].cpu_apicid = apicid;
+	ncpu++;
+}
+
+// Find the processors in the MP configuration table.  Returns true on
+// success.
+static bool
+mp_init_mptable(void)
+{
+	struct mp *mp;
+	struct mpconf *conf;
+	struct mpproc *proc;
+	uint8_t *p;
+	unsigned int i;
+
+	if ((conf = mpconfig(&mp)) == 0)
+		return 0;
+	lapicaddr = conf->lapicaddr;
+
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *)p;
+			cpu_add(proc->apicid, proc->flags & MPPROC_BOOT);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+		case MPIOAPIC:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("mpinit: unknown config type %x\n", *p);
+			return 0;
+		}
+	}
+
+	if (mp->imcrp) {
+		// [MP 3.2.6.1] If the hardware implements PIC mode,
+		// switch to getting interrupts from the LAPIC.
+		cprintf("SMP: Setting IMCR to switch from PIC mode to symmetric I/O mode\n");
+		outb(0x22, 0x70);   // Select IMCR
+		outb(0x23, inb(0x23) | 1);  // Mask external interrupts.
+	}
+	return 1;
+}
+
+// Returns the ACPI table at physical address 'pa' if it has signature
+// 'sig' and a good checksum, NULL otherwise.  Tables the kernel cannot
+// address through KADDR are ignored.
+static struct acpi_header *
+acpi_table(physaddr_t pa, const char *sig)
+{
+	physaddr_t lim = MIN(npages * PGSIZE, HIGHMEM_START);
+	struct acpi_header *h;
+
+	if (pa + sizeof(*h) > lim)
+		return NULL;
+	h = KADDR(pa);
+	if (memcmp(h->signature, sig, 4) != 0 || pa + h->length > lim
+	    || sum(h, h->length) != 0)
+		return NULL;
+	return h;
+}
+
+// Find the processors in the ACPI MADT, for machines without an MP
+// configuration table.  Returns true on success.
+static bool
+mp_init_acpi(void)
+{
+	struct acpi_rsdp *rsdp;
+	struct acpi_header *rsdt;
+	struct acpi_madt *madt = NULL;
+	struct acpi_madt_lapic *proc;
+	physaddr_t *entry;
+	uint32_t ebx;
+	uint8_t *p, *end;
+	int i, n;
+
+	if ((rsdp = tablesearch("RSD PTR ", 8, sizeof(*rsdp))) == 0)
+		return 0;
+	if ((rsdt = acpi_table(rsdp->rsdt, "RSDT")) == 0) {
+		cprintf("SMP: Bad ACPI RSDT\n");
+		return 0;
+	}
+	entry = (physaddr_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / sizeof(*entry);
+	for (i = 0; i < n && !madt; i++)
+		madt = (struct acpi_madt *) acpi_table(entry[i], "APIC");
+	if (!madt)
+		return 0;
+	lapicaddr = madt->lapicaddr;
+
+	// The MADT doesn't say which processor is the BSP; it is the one
+	// running this, whose initial APIC ID CPUID reports.
+	cpuid(1, NULL, &ebx, NULL, NULL);
+	end = (uint8_t *) madt + madt->header.length;
+	for (p = madt->entries; p + 2 <= end && p[1] >= 2; p += p[1]) {
+		if (*p != MADT_LAPIC)
+			continue;
+		proc = (struct acpi_madt_lapic *) p;
+		if (proc->flags & MADT_LAPIC_ENABLED)
+			cpu_add(proc->apicid, proc->apicid == ebx >> 24);
+	}
+	return 1;
+}
+
+void
+mp_init(void)
+{
+	// Each table must list the boot processor among those it finds,
+	// first: it has been using cpus[0] since before there was a local
+	// APIC to ask which CPU it is.
+	bootcpu = NULL;
+	ncpu = 0;
+	if (!(ismp = mp_init_mptable() && bootcpu == &cpus[0])) {
+		bootcpu = NULL;
+		ncpu = 0;
+		ismp = mp_init_acpi() && bootcpu == &cpus[0];
+	}
+
+	if (!ismp) {
+		// Didn't like what we found; fall back to no MP.
+		ncpu = 1;
+		bootcpu = &cpus[0];
+		bootcpu->cpu_id = 0;
+		lapicaddr = 0;
+		cprintf("SMP: configuration not found, SMP disabled\n");
+	} else
+		cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_id, ncpu);
+	bootcpu->cpu_status = CPU_STARTED;
+}
@@ -5,19 +5,118 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kmem.h>
+#include <kern/rmap.h>
+#include <kern/swap.h>
+
+struct PageInfo *zero_page;	// Shared by all untouched user memory
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
 static size_t npages_basemem;	// Amount of base memory (in pages)
 
+// The pages array must fit in the 4MB that entry_pgdir maps, alongside
+// the kernel, so physical memory above this is ignored.
+#define PHYSMEM_LIMIT	0x20000000	// 512MB
+
+// Usable RAM, page-aligned, below npages * PGSIZE
+static struct MemRange {
+	physaddr_t start;
+	physaddr_t end;
+} mem_ranges[E820_MAX];
+static int nmem_ranges;
+
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
+static bool pse_enabled;	// boot_map_region may use 4MB pages
+static uint32_t cr4_bits;	// CR4 flags mem_init set, for the other CPUs
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Physical memory zones.  Lowmem is mapped at KERNBASE and holds page
+// tables and kernel objects; highmem, from HIGHMEM_START up, is only
+// handed out to ALLOC_HIGHMEM callers.  A buddy block never straddles
+// HIGHMEM_START, since it is aligned to the largest block size.
+enum { ZONE_NORMAL, ZONE_HIGHMEM, NZONES };
+
+static struct PageInfo *page_free_list[NZONES][MAX_ORDER + 1];	// Buddy free
+								// lists, per
+								// zone and order
+
+// Protects the buddy free lists and the pre-zeroed pool.
+static struct spinlock page_lock = { 0, "page_lock", -1 };
+
+// Per-CPU magazines of free pages (see page_alloc).  Each CPU allocates
+// from and frees to its own magazine, which is refilled from and drained
+// to the buddy allocator PAGE_MAG_BATCH pages at a time, so the common
+// case takes no lock and touches no cache line shared with other CPUs.
+#define PAGE_MAG_SIZE		32	// Pages a magazine can hold
+#define PAGE_MAG_BATCH		16	// Pages moved per refill or drain
+
+struct PageMagazine {
+	int count;				// Pages in pages[]
+	struct PageInfo *pages[PAGE_MAG_SIZE];	// Top of stack is hottest
+	uint32_t allocs;			// Pages allocated from here
+	uint32_t refills;			// Batches taken from the buddy lists
+	uint32_t drains;			// Batches given back
+	uint32_t zero_misses;			// ALLOC_ZERO pages memset here
+} __attribute__((aligned(CACHELINE)));
+
+static struct PageMagazine page_mags[NCPU][NZONES];
+
+// Pre-zeroed page pool (see page_zero_idle)
+#define ZERO_POOL_TARGET	64	// Pages page_zero_idle keeps zeroed
+#define ZERO_POOL_BATCH		8	// Pages zeroed per page_zero_idle call
+
+static struct PageInfo *page_zero_list;	// Free, zero-filled pages
+static size_t page_zero_count;		// Length of page_zero_list
+static bool page_zero_enabled;		// All of memory is mapped
+
+static struct {
+	uint32_t hits;		// ALLOC_ZERO pages taken from the pool
+	uint32_t zeroed;	// Pages zeroed by page_zero_idle
+} zero_stats;		// Misses are counted per magazine
+
+// Pool of clean page-table pages (see pgtable_alloc)
+#define PGTABLE_POOL_MAX	64	// Most page tables kept for reuse
+
+static struct PageInfo *pgtable_pool;	// Clean page tables, via pp_link
+static size_t pgtable_pool_count;	// Length of pgtable_pool
+
+static struct {
+	uint32_t hits;		// Page tables reused from the pool
+	uint32_t misses;	// Page tables zeroed by page_alloc
+	uint32_t recycled;	// Freed page tables kept in the pool
+	uint32_t released;	// Freed page tables given to page_free
+} pgtable_stats;
+
+static struct {
+	uint32_t runs;		// page_compact calls
+	uint32_t blocks;	// Blocks it freed
+	uint32_t moved;		// Pages it migrated
+	uint64_t cycles;	// Time it took
+} compact_stats;
+
+// Temporary mappings of highmem pages (see kmap)
+#define NKMAP		(KMAPSIZE / PGSIZE)	// Number of kmap slots
+
+static pte_t *kmap_ptes;	// PTEs for [KMAPBASE, KMAPBASE + KMAPSIZE)
+static int kmap_next;		// Lowest slot not used since the last flush
+static struct spinlock kmap_lock = { 0, "kmap_lock", -1 };
+
+static struct {
+	uint32_t invlpgs;	// Single pages invalidated
+	uint32_t flushes;	// Full TLB flushes by tlb_gather_finish
+	uint32_t skipped;	// Invalidations of a pgdir not loaded
+	uint32_t shootdowns;	// Other CPUs told to flush (see tlb_shootdown)
+} tlb_stats;
 
 // User environments.
 struct Env *envs;
@@ -33,27 +132,110 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+// Record [start, end) as usable RAM, trimmed to whole pages below
+// PHYSMEM_LIMIT.
+static void
+mem_range_add(uint64_t start, uint64_t end)
+{
+	const uint64_t limit = PHYSMEM_LIMIT;
+	physaddr_t s, e;
+
+	s = ROUNDUP((physaddr_t) MIN(start, limit), PGSIZE);
+	e = ROUNDDOWN((physaddr_t) MIN(end, limit), PGSIZE);
+	if (s >= e || nmem_ranges == E820_MAX)
+		return;
+	mem_ranges[nmem_ranges].start = s;
+	mem_ranges[nmem_ranges].end = e;
+	nmem_ranges++;
+}
+
+// Read the BIOS E820 memory map that boot.S left in page 0.  Only the
+// first 4MB of physical memory is mapped yet, which covers it.
+// Returns false if the boot loader found no map.
+static bool
+e820_detect_memory(void)
+{
+	static const char *types[] = {
+		[E820_RAM] = "usable",
+		[E820_RESERVED] = "reserved",
+		[E820_ACPI] = "ACPI data",
+		[E820_NVS] = "ACPI NVS",
+	};
+	struct E820Map *e820 = (struct E820Map *) (KERNBASE + E820_MAP);
+	struct E820Entry *e;
+	uint64_t end;
+	uint32_t i;
+
+	if (e820->nr == 0 || e820->nr > E820_MAX)
+		return 0;
+
+	cprintf("E820 memory map:\n");
+	for (i = 0; i < e820->nr; i++) {
+		e = &e820->map[i];
+		end = e->e820_addr + e->e820_len;
+		if (e->e820_addr >> 32)
+			continue;	// Not addressable without PAE
+		cprintf("  %08x-%08x %s\n", (uint32_t) e->e820_addr,
+			(uint32_t) (end - 1),
+			e->e820_type < sizeof(types) / sizeof(types[0])
+			&& types[e->e820_type]
+			? types[e->e820_type] : "unknown");
+		if (e->e820_type == E820_RAM)
+			mem_range_add(e->e820_addr, end);
+	}
+	return nmem_ranges > 0;
+}
+
 static void
 i386_detect_memory(void)
 {
 	size_t npages_extmem;
+	int i;
 
-	// Use CMOS calls to measure available base & extended memory.
-	// (CMOS calls return results in kilobytes.)
-	npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
-	npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+	// Prefer the BIOS E820 map, which knows about all of memory and
+	// its holes.  Otherwise use CMOS calls to measure available base
+	// & extended memory.  (CMOS calls return results in kilobytes.)
+	if (!e820_detect_memory()) {
+		mem_range_add(0, nvram_read(NVRAM_BASELO) * 1024);
+		mem_range_add(EXTPHYSMEM,
+			      EXTPHYSMEM + nvram_read(NVRAM_EXTLO) * 1024);
+	}
 
 	// Calculate the number of physical pages available in both base
 	// and extended memory.
-	if (npages_extmem)
-		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
-	else
-		npages = npages_basemem;
+	npages = npages_basemem = npages_extmem = 0;
+	for (i = 0; i < nmem_ranges; i++) {
+		npages = MAX(npages, PGNUM(mem_ranges[i].end));
+		if (mem_ranges[i].start < IOPHYSMEM)
+			npages_basemem += PGNUM(MIN(mem_ranges[i].end, IOPHYSMEM)
+						- mem_ranges[i].start);
+		if (mem_ranges[i].end > EXTPHYSMEM)
+			npages_extmem += PGNUM(mem_ranges[i].end
+					       - MAX(mem_ranges[i].start, EXTPHYSMEM));
+	}
+	if (npages <= PGNUM(EXTPHYSMEM))
+		panic("i386_detect_memory: no extended memory");
 
 	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
 		npages * PGSIZE / 1024,
 		npages_basemem * PGSIZE / 1024,
 		npages_extmem * PGSIZE / 1024);
+	if (npages > PGNUM(HIGHMEM_START))
+		cprintf("Highmem: %uK above %uK\n",
+			(npages - PGNUM(HIGHMEM_START)) * PGSIZE / 1024,
+			HIGHMEM_START / 1024);
+}
+
+// Returns true if the page at physical address 'pa' is usable RAM.
+static bool
+page_is_ram(physaddr_t pa)
+{
+	int i;
+
+	for (i = 0; i < nmem_ranges; i++)
+		if (mem_ranges[i].start <= pa && pa < mem_ranges[i].end)
+			return 1;
+	return 0;
 }
 
 
@@ -68,6 +250,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void buddy_free(struct PageInfo *pp, int order);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -114,6 +297,10 @@ boot_alloc(uint32_t n)
 
     result = nextfree;
     nextfree += required_pages * PGSIZE;
+    // Only the first 4MB is mapped until mem_init loads kern_pgdir.
+    if (PADDR(nextfree) > PTSIZE) {
+        panic("boot_alloc: out of mapped memory");
+    }
     return result;
 }
 
@@ -129,8 +316,9 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t edx;
 	size_t n;
+	int i;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
@@ -183,11 +371,26 @@ mem_init(void)
 
 	check_page_free_list(1);
 	check_page_alloc();
-	check_page();
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
+	// Static mappings whose addresses are 4MB aligned use a single
+	// 4MB page directory entry instead of a page table, if the CPU
+	// supports it.  This saves a page table per 4MB and lots of TLB
+	// entries for the KERNBASE mapping below.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_PSE) {
+		cr4_bits |= CR4_PSE;
+		pse_enabled = 1;
+	}
+
+	// boot_map_region marks the static mappings global (PTE_G).  They
+	// are the same in every address space, so with CR4.PGE set their
+	// TLB entries survive the CR3 reloads in env_run and friends.
+	if (edx & CPUID_PGE)
+		cr4_bits |= CR4_PGE;
+
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
 	// Permissions:
@@ -195,8 +398,9 @@ mem_init(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
+	// ('pages' itself is covered by the KERNBASE mapping below.)
+    assert(pages_size <= PTSIZE);
     boot_map_region(kern_pgdir, UPAGES, ROUNDUP(pages_size, PGSIZE), PADDR(pages), PTE_U);
-    boot_map_region(kern_pgdir, (uintptr_t)pages, ROUNDUP(pages_size, PGSIZE), PADDR(pages), PTE_W);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -205,21 +409,32 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
+	// ('envs' itself is covered by the KERNBASE mapping below.)
     boot_map_region(kern_pgdir, UENVS, ROUNDUP(envs_size, PGSIZE), PADDR(envs), PTE_U);
-    boot_map_region(kern_pgdir, (uintptr_t)envs, ROUNDUP(envs_size, PGSIZE), PADDR(envs), PTE_W);
 
 	//////////////////////////////////////////////////////////////////////
-	// Use the physical memory that 'bootstack' refers to as the kernel
-	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
-	// We consider the entire range from [KSTACKTOP-PTSIZE, KSTACKTOP)
-	// to be the kernel stack, but break this into two pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
-	//       the kernel overflows its stack, it will fault rather than
-	//       overwrite memory.  Known as a "guard page".
+	// Map the per-CPU kernel stacks.  CPU i's stack grows down from
+	// KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is backed by
+	// percpu_kstacks[i]:
+	//     * [kstacktop_i - KSTKSIZE, kstacktop_i) -- backed by physical
+	//       memory
+	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//       -- not backed; so if the kernel overflows its stack, it will
+	//       fault rather than overwrite another CPU's stack.  Known as a
+	//       "guard page".
 	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
-    boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
+	// The boot CPU keeps running on bootstack until it first enters
+	// the scheduler; its traps use percpu_kstacks[0] like any other CPU.
+	for (i = 0; i < NCPU; i++)
+		boot_map_region(kern_pgdir, KSTACKTOP - i * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+				KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+
+	//////////////////////////////////////////////////////////////////////
+	// The kmap area at the bottom of the same PDE starts out unmapped.
+	// Keep a pointer to its page table, which every address space
+	// shares, so kmap can fill in its PTEs directly.
+	kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, 1);
+	assert(kmap_ptes);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -229,7 +444,8 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-    boot_map_region(kern_pgdir, KERNBASE, (2^32) - KERNBASE, (physaddr_t)0, PTE_W);
+    // 2^32 - KERNBASE, computed modulo 2^32.
+    boot_map_region(kern_pgdir, KERNBASE, -KERNBASE, (physaddr_t)0, PTE_W);
 
 	// Check that the initial page directory has been set up correctly.
 	check_kern_pgdir();
@@ -241,19 +457,47 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+
+	// All of physical memory is mapped now, so page_zero_idle can
+	// zero any free page.
+	page_zero_enabled = 1;
 
 	check_page_free_list(0);
 
+	// The reverse maps that page_insert keeps come from a slab cache,
+	// so the page table checks wait for the slab allocator.
+	kmem_init();
+	rmap_init();
+	check_page();
+
+	// Some more checks, only possible after kern_pgdir is installed.
+	check_page_installed_pgdir();
+
+	// Its own reference keeps the zero page from ever being freed.
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref = 1;
+}
+
+// Load kern_pgdir on this CPU, with the paging flags mem_init chose.
+// Each CPU calls this once; the application processors come up on
+// entry_pgdir, like the boot CPU did.
+void
+mem_init_percpu(void)
+{
+	uint32_t cr0;
+
+	// kern_pgdir may use 4MB pages, so CR4.PSE must be set first.
+	lcr4(rcr4() | cr4_bits);
+	lcr3(PADDR(kern_pgdir));
+
 	// entry.S set the really important flags in cr0 (including enabling
 	// paging).  Here we configure the rest of the flags that we care about.
 	cr0 = rcr0();
 	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_MP;
 	cr0 &= ~(CR0_TS|CR0_EM);
 	lcr0(cr0);
-
-	// Some more checks, only possible after kern_pgdir is installed.
-	check_page_installed_pgdir();
 }
 
 // --------------------------------------------------------------
@@ -288,30 +532,139 @@ page_init(void)
 	// Change the code to reflect this.
 	// NBD: DO NOT actually touch the physical memory corresponding to
 	// free pages!
+	//
+	// Which pages are RAM comes from the memory map that
+	// i386_detect_memory read from the BIOS.
+	//
+	// Free pages are handed straight to the buddy allocator, bypassing
+	// the per-CPU magazines, from the top of memory down, so each free
+	// list ends up with its lowest block at the head.  Until mem_init
+	// loads kern_pgdir only the first 4MB of physical memory is mapped,
+	// so early allocations must come from low memory.
 	size_t i;
     physaddr_t boot_heap_end = PADDR(boot_alloc(0));
-	for (i = 0; i < npages; i++) {
+	for (i = npages; i-- > 0; ) {
         pages[i].pp_ref = 0;
+        pages[i].pp_link = NULL;
+        pages[i].pp_flags = 0;
 
         physaddr_t paddr = page2pa(&pages[i]);
         // Page 0 is in use.
         bool page_0 = i == 0;
-        // The IO hole [IOPHYSMEM, EXTPHYSMEM]
-        bool io_hole = IOPHYSMEM <= paddr && paddr <= EXTPHYSMEM;
-        // Don't clobber the stuff allocated by boot_alloc.
-        bool boot_used = EXTPHYSMEM < paddr && paddr < boot_heap_end;
+        // Holes in the memory map, such as the IO hole
+        // [IOPHYSMEM, EXTPHYSMEM), and memory the BIOS reserved.
+        bool hole = !page_is_ram(paddr);
+        // Don't clobber the kernel or the stuff allocated by boot_alloc.
+        bool boot_used = EXTPHYSMEM <= paddr && paddr < boot_heap_end;
+        // The application processors' entry code is copied here.
+        bool mpentry = paddr == MPENTRY_PADDR;
 
         // not free pages
-        if (page_0 || io_hole || boot_used) {
+        if (page_0 || hole || boot_used || mpentry) {
             pages[i].pp_ref = 1;
-            pages[i].pp_link = NULL;
         } else {
-            pages[i].pp_link = page_free_list;
-            page_free_list = &pages[i];
+            buddy_free(&pages[i], 0);
         }
 	}
 }
 
+static struct PageInfo *buddy_alloc(int zone, int order);
+static struct PageInfo *page_zero_pop(void);
+static void page_zero_drain(void);
+static struct PageInfo *pgtable_pool_pop(void);
+static void pgtable_pool_drain(void);
+static int page_mag_refill(struct PageMagazine *mag, int zone);
+static void page_mag_drain(struct PageMagazine *mag, int n);
+static void page_mag_drain_all(void);
+
+// Returns the zone that the page 'pp' belongs to.
+static int
+page_zone(struct PageInfo *pp)
+{
+	return page_is_highmem(pp) ? ZONE_HIGHMEM : ZONE_NORMAL;
+}
+
+// Push the block headed by 'pp' onto its zone's free list for 'order'.
+static void
+free_list_push(struct PageInfo *pp, int order)
+{
+	struct PageInfo **head = &page_free_list[page_zone(pp)][order];
+
+	pp->pp_flags |= PP_FREE;
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = *head;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	*head = pp;
+}
+
+// Unlink the block headed by 'pp' from the free list for its order.
+static void
+free_list_remove(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_list[page_zone(pp)][pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_flags &= ~PP_FREE;
+	pp->pp_link = pp->pp_prev = NULL;
+}
+
+// Returns the buddy of the 2^order block headed by 'pp',
+// or NULL if the buddy would lie beyond the end of physical memory.
+static struct PageInfo *
+page_buddy(struct PageInfo *pp, int order)
+{
+	size_t idx = (pp - pages) ^ (1 << order);
+
+	if (idx + (1 << order) > npages)
+		return NULL;
+	return &pages[idx];
+}
+
+// Fill the 2^order block headed by 'pp' with zeros.  Highmem pages are
+// mapped and zeroed one at a time.
+static void
+page_clear(struct PageInfo *pp, int order)
+{
+	void *kva;
+	int i;
+
+	if (!page_is_highmem(pp)) {
+		memset(page2kva(pp), 0, PGSIZE << order);
+		return;
+	}
+	for (i = 0; i < (1 << order); i++) {
+		kva = kmap(pp + i);
+		memset(kva, 0, PGSIZE);
+		kunmap(kva);
+	}
+}
+
+// Take a page from this CPU's magazine for 'zone', refilling it from the
+// buddy allocator if it is empty.  Returns NULL if the zone is out of
+// free pages.
+static struct PageInfo *
+page_mag_alloc(int zone, int alloc_flags)
+{
+	struct PageMagazine *mag = &page_mags[cpunum()][zone];
+	struct PageInfo *pp;
+
+	if (mag->count == 0 && page_mag_refill(mag, zone) == 0)
+		return NULL;
+
+	pp = mag->pages[--mag->count];
+	mag->allocs++;
+	if (alloc_flags & ALLOC_ZERO) {
+		mag->zero_misses++;
+		page_clear(pp, 0);
+	}
+	return pp;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -324,50 +677,1032 @@ page_init(void)
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
+//
+// Single pages come from this CPU's magazine, which is refilled from the
+// buddy allocator in batches when it runs dry.  ALLOC_ZERO requests are
+// served from the pre-zeroed pool when it has a page to spare.
+//
+// With ALLOC_HIGHMEM, the page comes from highmem if any is free, so that
+// lowmem is kept for the kernel; the caller must kmap the page to touch
+// its contents.  Otherwise the page is always in lowmem.
+//
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-    if (page_free_list == NULL) {
-        // Out of memory
-        return NULL;
-    }
-    struct PageInfo *p = page_free_list;
+	struct PageInfo *pp;
+
+	if ((alloc_flags & ALLOC_HIGHMEM) && npages > PGNUM(HIGHMEM_START)
+	    && (pp = page_mag_alloc(ZONE_HIGHMEM, alloc_flags)))
+		return pp;
+
+	// A page from the pre-zeroed pool saves a memset.  Peek at the
+	// count without the lock so that an empty pool costs nothing.
+	if ((alloc_flags & ALLOC_ZERO) && page_zero_count) {
+		spin_lock(&page_lock);
+		if ((pp = page_zero_pop()))
+			zero_stats.hits++;
+		spin_unlock(&page_lock);
+		if (pp)
+			return pp;
+	}
+
+	if (!(pp = page_mag_alloc(ZONE_NORMAL, alloc_flags))) {
+		// Out of dirty memory: fall back on the pre-zeroed pool,
+		// then on the clean page tables kept for reuse.
+		spin_lock(&page_lock);
+		if (!(pp = page_zero_pop()))
+			pp = pgtable_pool_pop();
+		spin_unlock(&page_lock);
+	}
+
+	// Out of memory altogether: swap some user pages out and retry.
+	if (!pp && swap_reclaim(SWAP_CLUSTER) > 0)
+		return page_alloc(alloc_flags);
+	return pp;
+}
+
+//
+// Allocates a block of 2^order physically contiguous pages, aligned to its
+// own size, and returns the PageInfo of its first page.  A larger free
+// block is split in half as many times as needed; the unused halves go
+// back on the lower-order free lists.  ALLOC_ZERO zeroes the whole block,
+// and ALLOC_HIGHMEM works as for page_alloc.  As with page_alloc, no
+// reference counts are touched.  Blocks, even of order 0, come straight
+// from the buddy allocator; the per-CPU magazines are not involved.
+//
+// If no block of at least this order is free, page_compact is asked to
+// free one by moving user pages out of the way, so the caller must hold
+// the big kernel lock.
+//
+// Returns NULL if no block of this order is free and none can be made.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp = NULL;
+
+	assert(order >= 0 && order <= MAX_ORDER);
+
+	spin_lock(&page_lock);
+	if (alloc_flags & ALLOC_HIGHMEM)
+		pp = buddy_alloc(ZONE_HIGHMEM, order);
+	if (!pp && !(pp = buddy_alloc(ZONE_NORMAL, order))
+	    && (page_zero_list || pgtable_pool)) {
+		// Out of dirty memory: give the pre-zeroed pool and the
+		// page-table pool back to the buddy allocator, where they
+		// may merge, and retry.
+		page_zero_drain();
+		pgtable_pool_drain();
+		pp = buddy_alloc(ZONE_NORMAL, order);
+	}
+	spin_unlock(&page_lock);
+
+	if (!pp && order > 0 && page_compact(order, alloc_flags) >= 0) {
+		spin_lock(&page_lock);
+		if (alloc_flags & ALLOC_HIGHMEM)
+			pp = buddy_alloc(ZONE_HIGHMEM, order);
+		if (!pp)
+			pp = buddy_alloc(ZONE_NORMAL, order);
+		spin_unlock(&page_lock);
+	}
+	if (!pp)
+		return NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		page_clear(pp, order);
+	return pp;
+}
+
+// Take a free 2^order block off the buddy free lists of 'zone', splitting
+// a larger block if necessary.  Returns NULL if no large enough block is
+// free.
+static struct PageInfo *
+buddy_alloc(int zone, int order)
+{
+	struct PageInfo **free_list = page_free_list[zone];
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= MAX_ORDER && !free_list[k]; k++)
+		/* do nothing */;
+	if (k > MAX_ORDER)
+		return NULL;
+
+	pp = free_list[k];
+	free_list_remove(pp);
+
+	// Split, returning the upper half of each split to the free lists.
+	while (k > order) {
+		k--;
+		free_list_push(pp + (1 << k), k);
+	}
+	return pp;
+}
+
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+// The page goes on top of this CPU's magazine for its zone, where the
+// next page_alloc will find it still warm in the cache.  A full magazine
+// first gives its coldest PAGE_MAG_BATCH pages back to the buddy
+// allocator.
+//
+void
+page_free(struct PageInfo *pp)
+{
+	struct PageMagazine *mag = &page_mags[cpunum()][page_zone(pp)];
+
+	if (pp->pp_ref != 0)
+		panic("Page freed but pp_ref was non-zero.");
+	if (pp->pp_link != NULL || (pp->pp_flags & PP_FREE))
+		panic("Page freed but it is already free.");
+	if (pp->pp_rmap != 0)
+		panic("Page freed but it is still mapped.");
+	pp->pp_flags &= ~PP_PGTABLE;
+
+	if (mag->count == PAGE_MAG_SIZE)
+		page_mag_drain(mag, PAGE_MAG_BATCH);
+	mag->pages[mag->count++] = pp;
+}
+
+//
+// Return a 2^order block, as allocated by page_alloc_order, to the buddy
+// allocator.  While the block's buddy is also free it is merged with it,
+// so freeing never leaves two free buddies side by side.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (pp->pp_ref != 0)
+		panic("Page freed but pp_ref was non-zero.");
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+// Give a 2^order block back to the buddy free lists, merging it with its
+// free buddies.  The caller must hold page_lock (or be page_init).
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	struct PageInfo *buddy;
+
+	if (pp->pp_link != NULL || (pp->pp_flags & PP_FREE))
+		panic("Page freed but it is already free.");
+	if ((pp - pages) & ((1 << order) - 1))
+		panic("page_free_order: block not aligned to order %d", order);
+
+	while (order < MAX_ORDER) {
+		buddy = page_buddy(pp, order);
+		if (!buddy || !(buddy->pp_flags & PP_FREE)
+		    || buddy->pp_order != order)
+			break;
+		free_list_remove(buddy);
+		if (buddy < pp)
+			pp = buddy;
+		order++;
+	}
+	free_list_push(pp, order);
+}
+
+// --------------------------------------------------------------
+// Per-CPU page magazines.
+// A magazine is a small stack of free pages owned by one CPU.  Only
+// refills and drains take page_lock; they move PAGE_MAG_BATCH pages at
+// once so that the lock is taken at most once per batch of operations.
+// Pages in a magazine are allocated as far as the buddy allocator is
+// concerned.  Each CPU has one magazine per zone.
+// --------------------------------------------------------------
+
+// Fill an empty magazine with up to PAGE_MAG_BATCH pages of 'zone' from
+// the buddy allocator.  Returns the number of pages added.
+static int
+page_mag_refill(struct PageMagazine *mag, int zone)
+{
+	struct PageInfo *batch[PAGE_MAG_BATCH];
+	int i, n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PAGE_MAG_BATCH; n++)
+		if (!(batch[n] = buddy_alloc(zone, 0)))
+			break;
+	spin_unlock(&page_lock);
+
+	// Push in reverse so that pages are handed out in the order the
+	// buddy allocator gave them, lowest address first.
+	for (i = n; i-- > 0; )
+		mag->pages[mag->count++] = batch[i];
+	if (n)
+		mag->refills++;
+	return n;
+}
+
+// Give the 'n' pages at the bottom of the magazine, which are the
+// least recently freed, back to the buddy allocator.
+static void
+page_mag_drain(struct PageMagazine *mag, int n)
+{
+	int i;
+
+	if (n > mag->count)
+		n = mag->count;
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++)
+		buddy_free(mag->pages[i], 0);
+	spin_unlock(&page_lock);
+	memmove(mag->pages, mag->pages + n,
+		(mag->count - n) * sizeof(mag->pages[0]));
+	mag->count -= n;
+	mag->drains++;
+}
+
+// Empty every CPU's magazines into the buddy allocator, e.g. so that
+// their pages can be merged into larger blocks.  A CPU only uses its
+// magazines while holding the big kernel lock (page_bench aside), so the
+// caller must hold it once other CPUs may be running.
+static void
+page_mag_drain_all(void)
+{
+	struct PageMagazine *mag;
+	int i, zone;
+
+	assert(ncpu == 1 || spin_holding(&kernel_lock));
+	for (i = 0; i < NCPU; i++)
+		for (zone = 0; zone < NZONES; zone++) {
+			mag = &page_mags[i][zone];
+			if (mag->count)
+				page_mag_drain(mag, mag->count);
+		}
+}
+
+// --------------------------------------------------------------
+// Pre-zeroed page pool.
+// ALLOC_ZERO requests for single pages are served from page_zero_list,
+// a list of free pages whose contents are already zero (PP_ZERO), so the
+// caller does not wait for a memset.  page_zero_idle refills the pool
+// when the kernel has nothing better to do.  Pages in the pool are
+// allocated as far as the buddy allocator is concerned.
+// --------------------------------------------------------------
+
+static struct PageInfo *
+page_zero_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = page_zero_list))
+		return NULL;
+	page_zero_list = pp->pp_link;
+	page_zero_count--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_ZERO;
+	return pp;
+}
+
+// Return the whole pre-zeroed pool to the buddy allocator, e.g. so that
+// its pages can be merged into a larger block.  The caller must hold
+// page_lock.
+static void
+page_zero_drain(void)
+{
+	struct PageInfo *pp;
+
+	while ((pp = page_zero_pop()))
+		buddy_free(pp, 0);
+}
+
+//
+// Zero a few dirty free pages and move them to the pre-zeroed pool.
+// Called from the kernel's idle loops; does a bounded amount of work so
+// that the caller stays responsive.  page_lock is not held while a page
+// is being zeroed.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int n;
+
+	if (!page_zero_enabled || panicstr)
+		return;
+	for (n = 0; n < ZERO_POOL_BATCH && page_zero_count < ZERO_POOL_TARGET; n++) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(ZONE_NORMAL, 0);
+		spin_unlock(&page_lock);
+		if (!pp)
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_lock);
+		pp->pp_flags |= PP_ZERO;
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		zero_stats.zeroed++;
+		spin_unlock(&page_lock);
+	}
+}
+
+// --------------------------------------------------------------
+// Page-table pages.
+// Page tables are recycled through pgtable_pool, a stack of clean (all
+// zero) page-table pages, rather than zeroed by page_alloc each time one
+// is created and handed back to the page allocator each time one is
+// emptied.  A page table's PageInfo counts its non-zero entries in
+// pp_ptcount, so a table whose count drops to zero is known to be clean
+// without scanning it.  Everything that writes PTEs keeps the count up
+// to date, normally through pte_store.
+// --------------------------------------------------------------
+
+//
+// Allocate a clean page-table page, from the pool if possible.  As with
+// page_alloc, the reference count is not incremented.
+// Returns NULL if out of memory.
+//
+struct PageInfo *
+pgtable_alloc(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	if ((pp = pgtable_pool_pop()))
+		pgtable_stats.hits++;
+	spin_unlock(&page_lock);
+	if (!pp) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pgtable_stats.misses++;
+	}
+	pp->pp_flags |= PP_PGTABLE;
+	pp->pp_ptcount = 0;
+	return pp;
+}
+
+//
+// Free a page table whose last reference has gone.  Every entry must
+// have been cleared already, so that pp_ptcount is zero; the table then
+// goes back to the pool while it has room.
+//
+void
+pgtable_free(struct PageInfo *pp)
+{
+	if (pp->pp_ref != 0)
+		panic("pgtable_free: pp_ref is %d", pp->pp_ref);
+	if (pp->pp_ptcount != 0)
+		panic("pgtable_free: %d entries still in use", pp->pp_ptcount);
+
+	spin_lock(&page_lock);
+	if (pgtable_pool_count < PGTABLE_POOL_MAX) {
+		pp->pp_link = pgtable_pool;
+		pgtable_pool = pp;
+		pgtable_pool_count++;
+		pgtable_stats.recycled++;
+		pp = NULL;
+	}
+	spin_unlock(&page_lock);
+	if (pp) {
+		pgtable_stats.released++;
+		page_free(pp);
+	}
+}
+
+// Take a page off the page-table pool.  The caller must hold page_lock.
+static struct PageInfo *
+pgtable_pool_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = pgtable_pool))
+		return NULL;
+	pgtable_pool = pp->pp_link;
+	pgtable_pool_count--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_PGTABLE;
+	return pp;
+}
+
+// Return the whole page-table pool to the buddy allocator.  The caller
+// must hold page_lock.
+static void
+pgtable_pool_drain(void)
+{
+	struct PageInfo *pp;
+
+	while ((pp = pgtable_pool_pop()))
+		buddy_free(pp, 0);
+}
+
+// --------------------------------------------------------------
+// Compaction.
+// Free pages scatter over time, until a high-order allocation can fail
+// with plenty of memory free.  page_compact frees a whole aligned block
+// by migrating the pages in use in it elsewhere: each is copied to a
+// free page outside the block, and the PTEs in its reverse map are
+// pointed at the copy.  Only pages whose every reference is a mapping
+// in their reverse map can move; page tables, page directories and
+// kernel memory stay put.  A page that is kmapped must not be moved, so
+// nothing may allocate a high-order block while holding such a kmap.
+// --------------------------------------------------------------
+
+// Returns true if page 'pp' is in use and can be migrated, or swapped
+// out: every reference to it is a mapping in its reverse map.
+bool
+page_movable(struct PageInfo *pp)
+{
+	return pp->pp_ref > 0 && !(pp->pp_flags & (PP_PGTABLE | PP_LARGE))
+		&& rmap_count(pp) == pp->pp_ref;
+}
+
+// Returns the number of pages that must be migrated to free the 2^order
+// block at 'pp', or -1 if the block holds a page that can't be moved.
+// A block that is already free costs nothing.  The caller must hold
+// page_lock.
+static int
+compact_cost(struct PageInfo *pp, int order)
+{
+	struct PageInfo *end = pp + (1 << order);
+	int n = 0;
+
+	while (pp < end)
+		if (pp->pp_flags & PP_FREE)
+			pp += 1 << pp->pp_order;
+		else if (page_movable(pp)) {
+			n++;
+			pp++;
+		} else
+			return -1;
+	return n;
+}
+
+// Take a free page of 'zone' to migrate a page to.  It comes from a free
+// block smaller than 2^order, so that compaction never breaks up a block
+// as large as the one it is trying to make.  The caller must hold
+// page_lock.
+static struct PageInfo *
+compact_target(int zone, int order)
+{
+	int k;
+
+	for (k = 0; k < order && !page_free_list[zone][k]; k++)
+		/* do nothing */;
+	return k < order ? buddy_alloc(zone, 0) : NULL;
+}
+
+static int
+page_unmap_pte(pte_t *ptep, void *arg)
+{
+	*ptep &= ~PTE_P;
+	return 0;
+}
+
+static int
+page_remap_pte(pte_t *ptep, void *arg)
+{
+	*ptep |= PTE_P;
+	return 0;
+}
+
+static int
+page_migrate_pte(pte_t *ptep, void *arg)
+{
+	*ptep = *(physaddr_t *) arg | PGOFF(*ptep) | PTE_P;
+	return 0;
+}
+
+// Make every mapping of page 'pp' not present, keeping the rest of each
+// PTE for page_migrate or page_remap.  Once the TLBs are flushed, no CPU
+// can write to pp; one that touches it faults, and waits for the kernel
+// lock until the mappings are back.  So the caller must put them back
+// before it releases the lock.
+static void
+page_unmap(struct PageInfo *pp)
+{
+	rmap_walk(pp, page_unmap_pte, NULL);
+}
+
+// Undo page_unmap.
+static void
+page_remap(struct PageInfo *pp)
+{
+	rmap_walk(pp, page_remap_pte, NULL);
+}
+
+// Move the contents and mappings of page 'pp' to the free page 'npp',
+// leaving 'pp' unused.  The caller must have unmapped pp with
+// page_unmap and flushed every CPU's TLB, so that no write to pp is lost
+// in the copy; the new mappings then need no flush.
+static void
+page_migrate(struct PageInfo *pp, struct PageInfo *npp)
+{
+	physaddr_t pa = page2pa(npp);
+	void *src, *dst;
+
+	dst = kmap(npp);
+	src = kmap(pp);
+	memcpy(dst, src, PGSIZE);
+	kunmap(src);
+	kunmap(dst);
+
+	rmap_walk(pp, page_migrate_pte, &pa);
+	npp->pp_ref = pp->pp_ref;
+	npp->pp_rmap = pp->pp_rmap;
+	pp->pp_ref = 0;
+	pp->pp_rmap = 0;
+}
+
+// Free a 2^order block of 'zone', choosing the one that needs the fewest
+// pages migrated.  Returns the number of pages moved, or -E_NO_MEM if no
+// block could be freed.
+static int
+compact_zone(int zone, int order)
+{
+	size_t first, last, i;
+	struct PageInfo *pp, *npp, *block = NULL, *end;
+	int cost, best = 0, moved = 0;
+	bool done = 1;
+
+	first = zone == ZONE_HIGHMEM ? PGNUM(HIGHMEM_START) : 0;
+	last = zone == ZONE_HIGHMEM ? npages : MIN(npages, PGNUM(HIGHMEM_START));
+
+	spin_lock(&page_lock);
+	page_zero_drain();
+	pgtable_pool_drain();
+	for (i = first; i + (1 << order) <= last; i += 1 << order) {
+		cost = compact_cost(&pages[i], order);
+		if (cost > 0 && (!block || cost < best)) {
+			block = &pages[i];
+			best = cost;
+		}
+	}
+	if (!block) {
+		spin_unlock(&page_lock);
+		return -E_NO_MEM;
+	}
+
+	// Take the block's free pieces off the free lists, so that they
+	// can't be chosen as migration targets.
+	end = block + (1 << order);
+	for (pp = block; pp < end; )
+		if (pp->pp_flags & PP_FREE) {
+			i = 1 << pp->pp_order;
+			free_list_remove(pp);
+			pp += i;
+		} else
+			pp++;
+	spin_unlock(&page_lock);
+
+	// Unmap the pages to move, and flush them from every TLB, before
+	// copying any.  Only user pages move, and their mappings are not
+	// global.
+	for (pp = block; pp < end; pp++)
+		if (pp->pp_ref)
+			page_unmap(pp);
+	tlb_flush_all();
+
+	for (pp = block; pp < end; pp++) {
+		if (pp->pp_ref == 0)
+			continue;
+		npp = NULL;
+		if (done) {
+			spin_lock(&page_lock);
+			npp = compact_target(zone, order);
+			spin_unlock(&page_lock);
+		}
+		if (!npp) {
+			// Out of targets: leave the rest where they are.
+			done = 0;
+			page_remap(pp);
+			continue;
+		}
+		page_migrate(pp, npp);
+		moved++;
+	}
+
+	// Give the block's unused pages back.  If every page moved, they
+	// merge into one block of at least 2^order pages.
+	spin_lock(&page_lock);
+	for (pp = block; pp < end; pp++)
+		if (pp->pp_ref == 0)
+			buddy_free(pp, 0);
+	spin_unlock(&page_lock);
+
+	compact_stats.moved += moved;
+	return done ? moved : -E_NO_MEM;
+}
+
+//
+// Try to free a block of 2^order contiguous pages by migrating pages in
+// use, in the zones page_alloc_order(order, alloc_flags) would take it
+// from.  It empties every CPU's magazines, and takes page_lock itself,
+// so the caller must hold the big kernel lock but not page_lock.
+//
+// Returns the number of pages moved, or -E_NO_MEM if no block could be
+// freed.
+//
+int
+page_compact(int order, int alloc_flags)
+{
+	uint64_t start = read_tsc();
+	int r = -E_NO_MEM;
+
+	assert(order >= 0 && order <= MAX_ORDER);
+	page_mag_drain_all();
+	if ((alloc_flags & ALLOC_HIGHMEM) && npages > PGNUM(HIGHMEM_START))
+		r = compact_zone(ZONE_HIGHMEM, order);
+	if (r < 0)
+		r = compact_zone(ZONE_NORMAL, order);
+
+	compact_stats.runs++;
+	if (r >= 0)
+		compact_stats.blocks++;
+	compact_stats.cycles += read_tsc() - start;
+	return r;
+}
+
+
+// --------------------------------------------------------------
+// Page merging.
+// Two user pages with the same contents can share one physical page,
+// copy-on-write, as sys_fork's pages do.  page_merge moves every mapping
+// of one page onto the other through their reverse maps; kern/ksm.c
+// finds the pages to merge.
+// --------------------------------------------------------------
+
+struct page_merge_arg {
+	struct PageInfo *kp;	// Page being merged into
+	int n;			// Reverse map entries added to it
+};
+
+static int
+page_merge_add(pte_t *ptep, void *arg)
+{
+	struct page_merge_arg *a = arg;
+
+	if (rmap_add(a->kp, ptep) < 0)
+		return -E_NO_MEM;
+	a->n++;
+	return 0;
+}
+
+static int
+page_merge_undo(pte_t *ptep, void *arg)
+{
+	struct page_merge_arg *a = arg;
+
+	if (a->n == 0)
+		return 1;
+	rmap_remove(a->kp, ptep);
+	a->n--;
+	return 0;
+}
+
+static int
+page_wrprotect_pte(pte_t *ptep, void *arg)
+{
+	if (*ptep & PTE_W) {
+		*ptep = (*ptep & ~PTE_W) | PTE_COW;
+		*(bool *) arg = 1;
+	}
+	return 0;
+}
+
+//
+// Make every mapping of page 'pp' read-only, with PTE_COW where it was
+// writable, so that the next write to it breaks the sharing (see
+// env_cow_fault).  Returns true if any mapping changed, in which case
+// the caller must flush every CPU's TLB before relying on pp's contents
+// staying put.
+//
+bool
+page_wrprotect(struct PageInfo *pp)
+{
+	bool changed = 0;
+
+	rmap_walk(pp, page_wrprotect_pte, &changed);
+	return changed;
+}
+
+//
+// Point every mapping of page 'pp' at page 'kp', which must have the same
+// contents, and free 'pp'.  Both pages must be movable (see
+// page_movable), or 'kp' may be the zero page.  All of kp's mappings end
+// up read-only, with PTE_COW where they were writable, so the first
+// write to the shared page gives the writer its own copy again.
+//
+// The caller must have write-protected both pages with page_wrprotect,
+// and flushed every CPU's TLB, before finding them the same, so that no
+// write can have changed either since.  It must flush stale TLB entries
+// for pp again before pp can be reused.
+//
+// Returns 0 on success, -E_NO_MEM if a reverse map entry couldn't be
+// allocated, in which case both pages are left as they were.
+//
+int
+page_merge(struct PageInfo *pp, struct PageInfo *kp)
+{
+	struct page_merge_arg a = { kp, 0 };
+	physaddr_t pa = page2pa(kp);
+
+	assert(pp != kp && pp != zero_page);
+
+	// Pin both pages, in case rmap_add has to allocate.
+	pp->pp_ref++;
+	kp->pp_ref++;
+	if (rmap_walk(pp, page_merge_add, &a) < 0) {
+		rmap_walk(pp, page_merge_undo, &a);
+		pp->pp_ref--;
+		kp->pp_ref--;
+		return -E_NO_MEM;
+	}
+
+	// kp's reverse map now holds pp's PTEs as well.
+	page_wrprotect(kp);
+	rmap_walk(pp, page_migrate_pte, &pa);
+	kp->pp_ref += pp->pp_ref - 2;
+	rmap_clear(pp);
+	pp->pp_ref = 0;
+	page_free(pp);
+	return 0;
+}
+
+// Store 'pte' in the page table entry at 'ptep', keeping its page
+// table's count of non-zero entries.
+static void
+pte_store(pte_t *ptep, pte_t pte)
+{
+	struct PageInfo *pt = pa2page(PADDR(ptep));
+
+	pt->pp_ptcount += (pte != 0) - (*ptep != 0);
+	*ptep = pte;
+}
+
+//
+// Print the allocator's free memory, per-CPU magazine and pre-zeroed
+// pool statistics.
+//
+void
+page_print_stats(void)
+{
+	static const char *zone_names[NZONES] = { "normal", "highmem" };
+	struct PageMagazine *mag;
+	struct PageInfo *pp;
+	uint32_t total, misses = 0;
+	int zone, order, n, i;
+
+	spin_lock(&page_lock);
+	cprintf("Buddy free blocks (order: normal, highmem):\n");
+	for (order = 0; order <= MAX_ORDER; order++) {
+		cprintf("  %2d:", order);
+		for (zone = 0; zone < NZONES; zone++) {
+			n = 0;
+			for (pp = page_free_list[zone][order]; pp; pp = pp->pp_link)
+				n++;
+			cprintf(" %d", n);
+		}
+		cprintf("\n");
+	}
+	cprintf("Page magazines (cpu zone: pages, allocs, refills, drains):\n");
+	for (i = 0; i < ncpu; i++)
+		for (zone = 0; zone < NZONES; zone++) {
+			mag = &page_mags[i][zone];
+			cprintf("  %2d %-7s: %d/%d, %u, %u, %u\n", i,
+				zone_names[zone], mag->count, PAGE_MAG_SIZE,
+				mag->allocs, mag->refills, mag->drains);
+			misses += mag->zero_misses;
+		}
+	total = zero_stats.hits + misses;
+	cprintf("Zeroed pool: %d/%d pages, %d zeroed at idle\n",
+		page_zero_count, ZERO_POOL_TARGET, zero_stats.zeroed);
+	cprintf("ALLOC_ZERO: %d hits, %d misses (%d%% hit rate)\n",
+		zero_stats.hits, misses,
+		total ? zero_stats.hits * 100 / total : 0);
+	cprintf("Page-table pool: %d/%d pages, %u reused, %u zeroed, "
+		"%u recycled, %u released\n",
+		pgtable_pool_count, PGTABLE_POOL_MAX, pgtable_stats.hits,
+		pgtable_stats.misses, pgtable_stats.recycled,
+		pgtable_stats.released);
+	cprintf("Compaction: %u runs, %u blocks freed, %u pages moved, "
+		"%llu cycles\n", compact_stats.runs, compact_stats.blocks,
+		compact_stats.moved, compact_stats.cycles);
+	if (zero_page)
+		cprintf("Zero page: %u mappings\n", zero_page->pp_ref - 1);
+	spin_unlock(&page_lock);
+}
+
+// --------------------------------------------------------------
+// Temporary mappings of highmem pages.
+// A highmem page has no permanent kernel address.  kmap maps it at a
+// free slot in [KMAPBASE, KMAPBASE + KMAPSIZE) until kunmap.  The page
+// table for the area is shared by every address space, so a mapping is
+// visible whichever page directory is loaded, on every CPU.
+//
+// Any CPU may have cached a slot's translation, even one it never used,
+// so kunmap cannot make a slot clean everywhere.  Instead kmap hands out
+// slots in address order, and when it runs off the end it flushes every
+// CPU's TLB once and starts again from the bottom.
+// --------------------------------------------------------------
+
+//
+// Returns a kernel virtual address for the page 'pp'.  Lowmem pages are
+// returned at their KERNBASE address; highmem pages are mapped at a free
+// kmap slot.  Every kmap must be paired with a kunmap of the address it
+// returned, and mappings should be held only briefly: there are only
+// NKMAP slots, and kmap panics if they are all in use.
+//
+void *
+kmap(struct PageInfo *pp)
+{
+	int slot;
+
+	if (!page_is_highmem(pp))
+		return page2kva(pp);
+
+	spin_lock(&kmap_lock);
+	for (slot = kmap_next; slot < NKMAP && (kmap_ptes[slot] & PTE_P); slot++)
+		/* do nothing */;
+	if (slot == NKMAP) {
+		// Slots below kmap_next may still be cached for their old
+		// pages somewhere.
+		tlb_flush_all();
+		for (slot = 0; slot < NKMAP && (kmap_ptes[slot] & PTE_P); slot++)
+			/* do nothing */;
+		if (slot == NKMAP)
+			panic("kmap: all %d slots in use", NKMAP);
+	}
+	pte_store(&kmap_ptes[slot], page2pa(pp) | PTE_W | PTE_P);
+	kmap_next = slot + 1;
+	spin_unlock(&kmap_lock);
+	return (void *) (KMAPBASE + slot * PGSIZE);
+}
+
+//
+// Undo kmap.  'kva' is the address that kmap returned, and may be a
+// lowmem address, in which case there is nothing to do.  Only this CPU's
+// TLB entry is flushed here; other CPUs drop theirs before kmap reuses
+// the slot.
+//
+void
+kunmap(void *kva)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) kva, PGSIZE);
+
+	if (va < KMAPBASE || va >= KMAPBASE + KMAPSIZE)
+		return;
+	spin_lock(&kmap_lock);
+	assert(kmap_ptes[PGNUM(va - KMAPBASE)] & PTE_P);
+	pte_store(&kmap_ptes[PGNUM(va - KMAPBASE)], 0);
+	invlpg((void *) va);
+	spin_unlock(&kmap_lock);
+}
+
+// --------------------------------------------------------------
+// Allocator stress benchmark.
+// --------------------------------------------------------------
+
+#define PAGE_BENCH_BURST	64	// Pages held at once by each CPU
+#define PAGE_BENCH_ROUNDS	1000
+
+// A run of the benchmark on several CPUs at once.  The boot CPU sets it
+// up, and has the others run page_bench_ap through cpu_call.
+static struct {
+	bool use_mags;			// Whether the run uses the magazines
+	volatile bool go;		// Set when all CPUs are ready
+	volatile bool ready[NCPU];	// CPUs waiting for go
+	uint32_t cycles[NCPU];		// Time each CPU took; 0 if it ran out
+} page_bench_state;
+
+// Allocate and free PAGE_BENCH_ROUNDS bursts of pages on this CPU,
+// through the magazines or straight through the locked buddy allocator.
+// Returns the number of cycles taken, or 0 if memory ran out.
+static uint32_t
+page_bench_run(bool use_mags)
+{
+	struct PageInfo *burst[PAGE_BENCH_BURST];
+	uint64_t start;
+	int r, i;
+
+	bool oom = 0;
+
+	start = read_tsc();
+	for (r = 0; r < PAGE_BENCH_ROUNDS && !oom; r++) {
+		for (i = 0; i < PAGE_BENCH_BURST; i++) {
+			burst[i] = use_mags ? page_alloc(0) : page_alloc_order(0, 0);
+			if (!burst[i]) {
+				oom = 1;
+				break;
+			}
+		}
+		while (i-- > 0)
+			if (use_mags)
+				page_free(burst[i]);
+			else
+				page_free_order(burst[i], 0);
+	}
+	return oom ? 0 : read_tsc() - start;
+}
+
+// Run this CPU's part of the benchmark, starting with the others.
+static void
+page_bench_ap(void)
+{
+	int i = cpunum();
 
-    // Zero page if requested
-    if (alloc_flags & ALLOC_ZERO) {
-        memset(page2kva(p), '\0', PGSIZE);
-    }
+	page_bench_state.ready[i] = 1;
+	while (!page_bench_state.go)
+		asm volatile("pause");
+	page_bench_state.cycles[i] = page_bench_run(page_bench_state.use_mags);
+}
+
+// Run the benchmark on CPUs 0 to 'n' - 1 at once, this one included,
+// and return the cycles the slowest of them took, or 0 if memory ran
+// out.
+static uint32_t
+page_bench_cpus(int n, bool use_mags)
+{
+	uint32_t cycles = 0;
+	int i;
 
-    // Advance page_free_list pointer
-    page_free_list = p->pp_link;
-    p->pp_link = NULL;
-    return p;
+	page_bench_state.use_mags = use_mags;
+	page_bench_state.go = 0;
+	for (i = 1; i < n; i++) {
+		page_bench_state.ready[i] = 0;
+		cpus[i].cpu_call = page_bench_ap;
+	}
+	// The other CPUs pick up the call at their next timer interrupt,
+	// if not sooner, as they wait for the kernel lock.
+	for (i = 1; i < n; i++)
+		while (!page_bench_state.ready[i])
+			asm volatile("pause");
+	page_bench_state.go = 1;
+	page_bench_state.cycles[0] = page_bench_run(use_mags);
+	for (i = 1; i < n; i++)
+		while (cpus[i].cpu_call)
+			asm volatile("pause");
+
+	for (i = 0; i < n; i++) {
+		if (!page_bench_state.cycles[i])
+			return 0;
+		cycles = MAX(cycles, page_bench_state.cycles[i]);
+	}
+	return cycles;
 }
 
 //
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Measure page allocator throughput with and without the per-CPU
+// magazines, with 1, 2, ... ncpu CPUs allocating and freeing at once,
+// and report it for each CPU count, as the cycles per operation of all
+// the CPUs together.  Must be run on the boot CPU.
 //
 void
-page_free(struct PageInfo *pp)
+page_bench(void)
 {
-    if (pp->pp_ref != 0)
-		panic("Page freed but pp_ref was non-zero.");
-    if (pp->pp_link != NULL)
-		panic("Page freed but pp_link was non-null.");
-    // shift page onto beginning of page_free_list
-    pp->pp_link = page_free_list;
-    page_free_list = pp;
+	uint32_t ops, mag_cycles, global_cycles;
+	struct PageInfo *pp;
+	int n, order, nfree = 0;
+
+	assert(thiscpu == bootcpu && bootcpu == &cpus[0]);
+
+	// The other CPUs run without the kernel lock, so the benchmark must
+	// not run memory out: page_alloc would swap, which needs the lock.
+	spin_lock(&page_lock);
+	for (order = 0; order <= MAX_ORDER; order++)
+		for (pp = page_free_list[ZONE_NORMAL][order]; pp; pp = pp->pp_link)
+			nfree += 1 << order;
+	spin_unlock(&page_lock);
+	if (nfree < 2 * ncpu * (PAGE_BENCH_BURST + PAGE_MAG_SIZE)) {
+		cprintf("not enough free memory\n");
+		return;
+	}
+
+	ops = 2 * PAGE_BENCH_ROUNDS * PAGE_BENCH_BURST;
+	cprintf("Page allocator: %u alloc+free ops per CPU\n", ops);
+	cprintf("cpus  magazine cyc/op  global cyc/op\n");
+	for (n = 1; n <= ncpu; n++) {
+		mag_cycles = page_bench_cpus(n, 1);
+		global_cycles = page_bench_cpus(n, 0);
+		if (!mag_cycles || !global_cycles) {
+			cprintf("out of memory\n");
+			return;
+		}
+		cprintf("%4d  %15u  %13u\n", n,
+			mag_cycles / (n * ops), global_cycles / (n * ops));
+	}
 }
 
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
+// The first page of a 4MB user page frees the whole block.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (--pp->pp_ref != 0)
+		return;
+	if (pp->pp_flags & PP_LARGE) {
+		pp->pp_flags &= ~PP_LARGE;
+		page_free_order(pp, MAX_ORDER);
+	} else
 		page_free(pp);
 }
 
@@ -375,9 +1710,12 @@ page_decref(struct PageInfo* pp)
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
 //
+// If 'va' is mapped by a 4MB page, pgdir_walk returns a pointer to the
+// page directory entry instead; callers can tell by PTE_PS being set.
+//
 // The relevant page table page might not exist yet.
 // If this is true, and create == false, then pgdir_walk returns NULL.
-// Otherwise, pgdir_walk allocates a new page table page with page_alloc.
+// Otherwise, pgdir_walk allocates a new page table page with pgtable_alloc.
 //    - If the allocation fails, pgdir_walk returns NULL.
 //    - Otherwise, the new page's reference count is incremented,
 //	the page is cleared,
@@ -402,6 +1740,11 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     pde_t *pgdir_entry = &pgdir[pgdir_index];
     physaddr_t pgtable_paddr = *pgdir_entry;
     if (pgtable_paddr & PTE_P) {
+        if (pgtable_paddr & PTE_PS) {
+            // A 4MB page: there is no page table, and the page
+            // directory entry itself maps 'va'.
+            return pgdir_entry;
+        }
         // Page table present.
         // remove the flags
         pgtable_paddr = PTE_ADDR(pgtable_paddr);
@@ -413,7 +1756,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
         if (create) {
             // We should allocate a new page table.
             struct PageInfo *pgtable_pinfo;
-            if (!(pgtable_pinfo = page_alloc(ALLOC_ZERO))) {
+            if (!(pgtable_pinfo = pgtable_alloc())) {
                 // Failed to allocate page for pgtable.
                 return NULL;
             }
@@ -435,6 +1778,19 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     }
 }
 
+// Like pgdir_walk, but for a run of 'npte' pages starting at 'va'.
+// Returns a pointer to the PTE for 'va' and stores in *run how many of
+// the run's PTEs follow it in the same page table, so that the caller
+// can handle them all with a single walk.  If 'va' is mapped by a 4MB
+// page, returns the page directory entry as pgdir_walk does.
+static pte_t *
+pgdir_walk_run(pde_t *pgdir, uintptr_t va, size_t npte, int create,
+	       size_t *run)
+{
+	*run = MIN(npte, NPTENTRIES - PTX(va));
+	return pgdir_walk(pgdir, (void *) va, create);
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
@@ -443,25 +1799,69 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 //
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
-// mapped pages.
+// mapped pages.  Since these mappings are shared by every address space,
+// they are also marked global (PTE_G).
 //
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
-    size_t required_pages = size / PGSIZE;
-    size_t page_offset = 0;
-    for (page_offset = 0; page_offset < required_pages; page_offset++) {
-        uintptr_t va_local = va + page_offset * PGSIZE;
-        physaddr_t pa_local = pa + page_offset * PGSIZE;
+    size_t offset = 0, run, i;
+    while (offset < size) {
+        uintptr_t va_local = va + offset;
+        physaddr_t pa_local = pa + offset;
+
+        // Map whole, aligned 4MB chunks with a single page directory
+        // entry when PSE is enabled.
+        if (pse_enabled && size - offset >= PTSIZE
+            && va_local % PTSIZE == 0 && pa_local % PTSIZE == 0) {
+            if (pgdir[PDX(va_local)] & PTE_P)
+                panic("boot_map_region: %08x already mapped", va_local);
+            pgdir[PDX(va_local)] = pa_local | perm | PTE_P | PTE_PS | PTE_G;
+            offset += PTSIZE;
+            continue;
+        }
+
+        // Otherwise fill the rest of this page table in one go.
         pte_t *pgtable_entry;
-        if (!(pgtable_entry = pgdir_walk(pgdir, (void*)va_local, true))) {
+        if (!(pgtable_entry = pgdir_walk_run(pgdir, va_local, (size - offset) / PGSIZE,
+                                             true, &run))) {
             panic("Could not allocate page for page table while using boot_map_region.");
         }
-        *pgtable_entry = PTE_ADDR(pa_local) | perm | PTE_P;
+        for (i = 0; i < run; i++) {
+            pte_store(&pgtable_entry[i], PTE_ADDR(pa_local + i * PGSIZE) | perm | PTE_P | PTE_G);
+        }
+        offset += run * PGSIZE;
     }
 }
 
+//
+// Reserve size bytes in the MMIO region and map [pa,pa+size) at this
+// location.  Return the base of the reserved region.  size does *not*
+// have to be multiple of PGSIZE.
+//
+// Device memory must not be cached, so the mapping is uncached and
+// write-through (PTE_PCD|PTE_PWT).  The MMIO region's page table is in
+// kern_pgdir before any environment exists, so every address space
+// shares it.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	// Where to start the next region.  Initially, this is the
+	// beginning of the MMIO region.
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va = base;
+
+	size = ROUNDUP(pa + size, PGSIZE) - ROUNDDOWN(pa, PGSIZE);
+	if (base + size > MMIOLIM || base + size < base)
+		panic("mmio_map_region: out of MMIO space");
+	boot_map_region(kern_pgdir, va, size, ROUNDDOWN(pa, PGSIZE),
+			PTE_PCD | PTE_PWT | PTE_W);
+	base += size;
+	return (void *) (va + PGOFF(pa));
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -490,20 +1890,156 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
+    // Increment refcount before calling remove so it doesn't get freed,
+    // and before allocating a page table so it can't be swapped out.
+    pp->pp_ref += 1;
+
     // Get the pgtable entry that we will assign.
     pte_t *pgtable_entry = pgdir_walk(pgdir, va, true);
-    if (!pgtable_entry) return -E_NO_MEM;
+    if (pgtable_entry && (*pgtable_entry & PTE_PS)) {
+        // Replacing part of a 4MB user page unmaps all of it.
+        if ((uintptr_t) va >= UTOP)
+            panic("page_insert: %08x is inside a 4MB page", va);
+        page_remove(pgdir, va);
+        pgtable_entry = pgdir_walk(pgdir, va, true);
+    }
 
-    // Increment refcount before calling remove so it doesn't get freed.
-    pp->pp_ref += 1;
+    // The reverse map may briefly hold this PTE twice if pp is
+    // already mapped here.
+    if (!pgtable_entry || rmap_add(pp, pgtable_entry) < 0) {
+        pp->pp_ref -= 1;
+        return -E_NO_MEM;
+    }
     page_remove(pgdir, va);
 
     // Assign mapping.
     physaddr_t pa = page2pa(pp);
-    *pgtable_entry = PTE_ADDR(pa) | perm | PTE_P;
+    pte_store(pgtable_entry, PTE_ADDR(pa) | perm | PTE_P);
     return 0;
 }
 
+//
+// Map the 'n' pages pps[0], pps[1], ... at consecutive virtual addresses
+// starting at 'va', with permissions 'perm|PTE_P', as n calls to
+// page_insert would.  Each page table is walked once for its whole run
+// of pages, and the TLB entries of replaced mappings are gathered and
+// flushed together at the end.
+//
+// All the page tables needed are allocated before anything is mapped, so
+// if one can't be, the range is left as it was.  A page's first mapping
+// never allocates its reverse map; if a page that is already mapped
+// elsewhere can't get another entry, the pages before it stay mapped.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table or reverse map entry couldn't be
+//     allocated
+//
+int
+page_insert_range(pde_t *pgdir, struct PageInfo **pps, size_t n, void *va,
+		  int perm)
+{
+	uintptr_t start = (uintptr_t) va;
+	struct PageInfo *pt, *pp;
+	struct tlb_gather tg;
+	size_t i, j, run;
+	pte_t *pte;
+
+	for (i = 0; i < n; i += run) {
+		pte = pgdir_walk_run(pgdir, start + i * PGSIZE, n - i, 1, &run);
+		if (!pte)
+			return -E_NO_MEM;
+		if (*pte & PTE_PS)
+			panic("page_insert_range: %08x is inside a 4MB page",
+			      start + i * PGSIZE);
+	}
+
+	tlb_gather_init(&tg, pgdir);
+	for (i = 0; i < n; i += run) {
+		pte = pgdir_walk_run(pgdir, start + i * PGSIZE, n - i, 0, &run);
+		pt = pa2page(PADDR(pte));
+		for (j = 0; j < run; j++) {
+			// Take the new reference first, in case the page
+			// is already mapped here.
+			pps[i + j]->pp_ref++;
+			if (rmap_add(pps[i + j], &pte[j]) < 0) {
+				pps[i + j]->pp_ref--;
+				tlb_gather_finish(&tg);
+				return -E_NO_MEM;
+			}
+			if (pte[j] & PTE_P) {
+				pp = pa2page(PTE_ADDR(pte[j]));
+				rmap_remove(pp, &pte[j]);
+				page_decref(pp);
+				tlb_gather_add(&tg, start + (i + j) * PGSIZE);
+			} else if (PTE_IS_SWAP(pte[j]))
+				swap_free(pte[j]);
+			if (!pte[j])
+				pt->pp_ptcount++;
+			pte[j] = page2pa(pps[i + j]) | perm | PTE_P;
+		}
+	}
+	tlb_gather_finish(&tg);
+	return 0;
+}
+
+//
+// Map the 4MB page whose first 4KB page is 'pp', a block allocated with
+// page_alloc_order(MAX_ORDER, ...), at the 4MB-aligned user address
+// 'va', with permissions 'perm|PTE_PS|PTE_P', using a single page
+// directory entry.  Whatever was mapped in [va, va+PTSIZE) is unmapped
+// first.  pp holds the reference count and reverse map for the whole
+// 4MB page.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if the CPU doesn't support 4MB pages
+//   -E_NO_MEM, if a reverse map entry couldn't be allocated
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+
+	assert((uintptr_t) va < UTOP && (uintptr_t) va % PTSIZE == 0);
+	assert(page2pa(pp) % PTSIZE == 0);
+	if (!pse_enabled)
+		return -E_INVAL;
+
+	// As in page_insert, take the new reference first.
+	pp->pp_ref++;
+	if (rmap_add(pp, pde) < 0) {
+		pp->pp_ref--;
+		return -E_NO_MEM;
+	}
+	page_remove_range(pgdir, va, PTSIZE);
+
+	pp->pp_flags |= PP_LARGE;
+	*pde = page2pa(pp) | perm | PTE_PS | PTE_P;
+	return 0;
+}
+
+//
+// Map the shared zero page at 'va', in place of anything mapped there,
+// for memory that reads as zero until first written.  If 'perm' has
+// PTE_W, the mapping is read-only and PTE_COW instead, and the first
+// write gives the page a private copy (see env_cow_fault).
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated, or the zero page
+//     already has ZERO_PAGE_MAXREF references
+//
+int
+page_insert_zero(pde_t *pgdir, void *va, int perm)
+{
+	if (zero_page->pp_ref >= ZERO_PAGE_MAXREF)
+		return -E_NO_MEM;
+	if (perm & PTE_W)
+		perm = (perm & ~PTE_W) | PTE_COW;
+	return page_insert(pgdir, zero_page, va, perm);
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -511,6 +2047,10 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 // can be used to verify page permissions for syscall arguments,
 // but should not be used by most callers.
 //
+// If 'va' is in a 4MB page, the page directory entry is stored instead,
+// and the first 4KB page of the 4MB page is returned: it holds the
+// reference count for all of it.
+//
 // Return NULL if there is no page mapped at va.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
@@ -525,6 +2065,9 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
     if (pgtable_entry == NULL) return NULL;
     if (!(*pgtable_entry & PTE_P)) return NULL;
     physaddr_t page_paddr = PTE_ADDR(*pgtable_entry);
+    if (*pgtable_entry & PTE_PS) {
+        page_paddr = PDE_PS_ADDR(*pgtable_entry);
+    }
     struct PageInfo *pinfo = pa2page(page_paddr);
     return pinfo;
 }
@@ -550,33 +2093,364 @@ page_remove(pde_t *pgdir, void *va)
     pte_t *pgtable_entry;
     struct PageInfo *pp;
     if (!(pp = page_lookup(pgdir, va, &pgtable_entry))) {
+        // A swapped-out page just gives up its swap slot.
+        if (pgtable_entry && PTE_IS_SWAP(*pgtable_entry)) {
+            swap_free(*pgtable_entry);
+            pte_store(pgtable_entry, 0);
+        }
         // No mapping, return after no op.
         return;
     }
 
+    // A 4MB page goes all at once.
+    if (*pgtable_entry & PTE_PS) {
+        if ((uintptr_t) va >= UTOP)
+            panic("page_remove: %08x is inside a 4MB page", va);
+        page_remove_range(pgdir, ROUNDDOWN(va, PTSIZE), PTSIZE);
+        return;
+    }
+
     // Reference counting.
     if (pp->pp_ref <= 0) panic("page_remove found a page with negative ref count"); 
+    rmap_remove(pp, pgtable_entry);
     page_decref(pp);
 
     // Remove page from paging map.
-    *pgtable_entry = 0;
+    pte_store(pgtable_entry, 0);
     tlb_invalidate(pgdir, va);
 }
 
+//
+// Unmap every page in [va, va+size), as page_remove would for each page,
+// where va and size are page-aligned.  Each page table is walked once
+// for its whole run of pages, and the TLB is flushed together at the
+// end.  User page tables (below UTOP) left empty go back to the
+// page-table pool; kernel page tables are shared by every environment,
+// so they are kept.  A 4MB user page in the range must lie wholly
+// inside it.
+//
+void
+page_remove_range(pde_t *pgdir, void *va, size_t size)
+{
+	uintptr_t start = (uintptr_t) va, cur;
+	size_t n = size / PGSIZE, i, j, run;
+	struct PageInfo *ptpage, *pp;
+	struct tlb_gather tg;
+	pte_t *pt;
+
+	assert(start % PGSIZE == 0 && size % PGSIZE == 0);
+
+	tlb_gather_init(&tg, pgdir);
+	for (i = 0; i < n; i += run) {
+		cur = start + i * PGSIZE;
+		run = MIN(n - i, NPTENTRIES - PTX(cur));
+		if (!(pgdir[PDX(cur)] & PTE_P))
+			continue;
+		if (pgdir[PDX(cur)] & PTE_PS) {
+			if (cur >= UTOP || run != NPTENTRIES)
+				panic("page_remove_range: %08x is inside a 4MB page",
+				      cur);
+			pp = pa2page(PDE_PS_ADDR(pgdir[PDX(cur)]));
+			rmap_remove(pp, &pgdir[PDX(cur)]);
+			page_decref(pp);
+			pgdir[PDX(cur)] = 0;
+			tlb_gather_add(&tg, cur);
+			continue;
+		}
+
+		// Stop early once the table's last entry is gone.
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[PDX(cur)]));
+		ptpage = pa2page(PADDR(pt));
+		for (j = PTX(cur); j < PTX(cur) + run && ptpage->pp_ptcount; j++)
+			if (pt[j] & PTE_P) {
+				pp = pa2page(PTE_ADDR(pt[j]));
+				rmap_remove(pp, &pt[j]);
+				page_decref(pp);
+				pt[j] = 0;
+				ptpage->pp_ptcount--;
+				tlb_gather_add(&tg, cur + (j - PTX(cur)) * PGSIZE);
+			} else if (PTE_IS_SWAP(pt[j])) {
+				swap_free(pt[j]);
+				pt[j] = 0;
+				ptpage->pp_ptcount--;
+			}
+
+		if (cur < UTOP && ptpage->pp_ptcount == 0) {
+			// The invalidation also drops any cached copy of
+			// the page directory entry.
+			pgdir[PDX(cur)] = 0;
+			if (--ptpage->pp_ref == 0)
+				pgtable_free(ptpage);
+			tlb_gather_add(&tg, cur);
+		}
+	}
+	tlb_gather_finish(&tg);
+}
+
+// Returns true if a TLB entry for 'va' under 'pgdir' may be cached on
+// this CPU: either 'pgdir' is loaded, or 'va' is in the kernel part of
+// the address space, whose page tables every page directory shares.
+static bool
+tlb_may_cache(pde_t *pgdir, uintptr_t va)
+{
+	return va >= UTOP || PADDR(pgdir) == rcr3();
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Other CPUs running in 'pgdir' are told to flush too.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	// For now, there is only one address space, so always invalidate.
-	invlpg(va);
+	if (tlb_may_cache(pgdir, (uintptr_t) va)) {
+		invlpg(va);
+		tlb_stats.invlpgs++;
+	} else
+		tlb_stats.skipped++;
+	tlb_shootdown((uintptr_t) va >= UTOP ? NULL : pgdir);
+}
+
+// --------------------------------------------------------------
+// TLB shootdown.
+// A CPU that changes PTEs another CPU may have cached sets that CPU's
+// cpu_tlb_flush flag, sends it an IRQ_TLB interrupt, and waits for it
+// to flush its TLB and clear the flag.  Targets flush all of their TLB
+// rather than being told which pages changed: shootdowns are rare
+// enough that it is not worth the bookkeeping.
+//
+// The sender holds the kernel lock while it waits.  A target that is
+// in user mode takes the interrupt without touching the lock (see
+// trap), and one that is waiting for the lock, with interrupts off,
+// checks its flag as it spins (see lock_kernel), so neither deadlocks.
+// --------------------------------------------------------------
+
+// Flush this CPU's whole TLB, global entries included.
+static void
+tlb_flush_local(void)
+{
+	uint32_t cr4;
+
+	if ((cr4 = rcr4()) & CR4_PGE) {
+		// Toggling CR4.PGE flushes global entries too.
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		tlbflush();
+}
+
+//
+// Make the other CPUs that may have TLB entries from 'pgdir' flush
+// them, and wait until they have.  If pgdir is NULL, every other CPU
+// flushes; that is for changes to the kernel's mappings, or to user
+// mappings in address spaces that are not known.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+
+	if (ncpu == 1)
+		return;
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_status == CPU_UNUSED)
+			continue;
+		if (pgdir && !(c->cpu_env && c->cpu_env->env_pgdir == pgdir))
+			continue;
+		c->cpu_tlb_flush = 1;
+		lapic_ipi(c->cpu_apicid, IRQ_OFFSET + IRQ_TLB);
+		tlb_stats.shootdowns++;
+	}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_flush)
+			asm volatile("pause");
+}
+
+//
+// Flush this CPU's TLB if another CPU asked it to with tlb_shootdown.
+//
+void
+tlb_shootdown_recv(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (!c->cpu_tlb_flush)
+		return;
+	tlb_flush_local();
+	c->cpu_tlb_flush = 0;
+}
+
+//
+// Flush the user mappings from every CPU's TLB, after changing PTEs
+// in many address spaces at once.
+//
+void
+tlb_flush_all(void)
+{
+	tlbflush();
+	tlb_shootdown(NULL);
+}
+
+// --------------------------------------------------------------
+// TLB gathering.
+// An operation that changes many PTEs, such as page_remove_range, first
+// gathers the addresses whose TLB entries go stale, then invalidates
+// them all at once with tlb_gather_finish once its page tables are
+// consistent.  That is also the point at which other CPUs running the
+// same address space will need to be told.
+// --------------------------------------------------------------
+
+// Gathers of more than this many pages reload CR3 rather than issuing
+// one invlpg per page.  At most TLB_GATHER_MAX.
+size_t tlb_flush_threshold = 32;
+
+// Start gathering invalidations for an operation on 'pgdir'.
+void
+tlb_gather_init(struct tlb_gather *tg, pde_t *pgdir)
+{
+	tg->pgdir = pgdir;
+	tg->n = 0;
+	tg->kernel = 0;
+	tg->remote = 0;
+}
+
+// Note that the TLB entry for 'va' under tg->pgdir has gone stale.
+// Addresses that this CPU cannot have cached are dropped right away,
+// though other CPUs may still have to flush them.
+void
+tlb_gather_add(struct tlb_gather *tg, uintptr_t va)
+{
+	tg->remote = 1;
+	if (!tlb_may_cache(tg->pgdir, va)) {
+		tlb_stats.skipped++;
+		return;
+	}
+	if (tg->n < TLB_GATHER_MAX)
+		tg->va[tg->n] = va;
+	tg->n++;
+	if (va >= UTOP)
+		tg->kernel = 1;
+}
+
+// Invalidate the TLB entries gathered in 'tg': one invlpg each, or one
+// full flush if there are more than tlb_flush_threshold of them.  A full
+// flush of kernel addresses must also flush global (PTE_G) entries.
+// Then shoot down the entries on the other CPUs.
+void
+tlb_gather_finish(struct tlb_gather *tg)
+{
+	size_t i;
+
+	if (tg->n > MIN(tlb_flush_threshold, TLB_GATHER_MAX)) {
+		if (tg->kernel)
+			tlb_flush_local();
+		else
+			tlbflush();
+		tlb_stats.flushes++;
+	} else {
+		for (i = 0; i < tg->n; i++)
+			invlpg((void *) tg->va[i]);
+		tlb_stats.invlpgs += tg->n;
+	}
+	if (tg->remote)
+		tlb_shootdown(tg->kernel ? NULL : tg->pgdir);
+	tg->n = 0;
+	tg->kernel = 0;
+	tg->remote = 0;
+}
+
+//
+// Print TLB invalidation statistics.
+//
+void
+tlb_print_stats(void)
+{
+	cprintf("TLB invalidation: %u invlpg, %u full flushes, "
+		"%u skipped (pgdir not loaded), %u shootdowns\n",
+		tlb_stats.invlpgs, tlb_stats.flushes, tlb_stats.skipped,
+		tlb_stats.shootdowns);
+	cprintf("Full flush above %u pages per operation\n",
+		MIN(tlb_flush_threshold, TLB_GATHER_MAX));
+}
+
+#define TLB_BENCH_ROUNDS	1000
+#define TLB_BENCH_PAGES		64	// Kernel pages touched per switch
+
+// Time TLB_BENCH_ROUNDS simulated context switches: reload CR3, then
+// touch a spread of pages through the KERNBASE mapping, as the kernel
+// does on its way back to user mode.  Returns cycles per switch.
+static uint32_t
+tlb_bench_run(void)
+{
+	uint32_t cr3 = rcr3(), stride;
+	uint64_t start;
+	int r, i;
+
+	stride = MAX(npages / TLB_BENCH_PAGES, 1) * PGSIZE;
+	start = read_tsc();
+	for (r = 0; r < TLB_BENCH_ROUNDS; r++) {
+		lcr3(cr3);
+		for (i = 0; i < TLB_BENCH_PAGES; i++)
+			(void) *(volatile uint32_t *) (KERNBASE + i * stride);
+	}
+	return (uint32_t) (read_tsc() - start) / TLB_BENCH_ROUNDS;
+}
+
+//
+// Measure the cost of an address-space switch with and without global
+// kernel TLB entries, by toggling CR4.PGE.
+//
+void
+tlb_bench(void)
+{
+	uint32_t cr4 = rcr4(), edx, global, nonglobal;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_PGE)) {
+		cprintf("This CPU does not support global pages.\n");
+		return;
+	}
+
+	// Clearing CR4.PGE also flushes every global TLB entry.
+	lcr4(cr4 & ~CR4_PGE);
+	nonglobal = tlb_bench_run();
+	lcr4(cr4 | CR4_PGE);
+	global = tlb_bench_run();
+	lcr4(cr4);
+
+	cprintf("CR3 reload + %d kernel page touches:\n", TLB_BENCH_PAGES);
+	cprintf("  without PTE_G: %u cycles\n", nonglobal);
+	cprintf("  with PTE_G:    %u cycles\n", global);
 }
 
 static uintptr_t user_mem_check_addr;
 
+// Returns true if env's page directory and page table both give 'perm'
+// for the page at 'va', which must be below UTOP.
+static bool
+user_mem_perm(struct Env *env, uintptr_t va, int perm)
+{
+	pte_t *pte = pgdir_walk(env->env_pgdir, (void *) va, 0);
+
+	return pte && (env->env_pgdir[PDX(va)] & perm) == perm
+		&& (*pte & perm) == perm;
+}
+
+// Try to make the page at 'va' accessible to env with 'perm', as the page
+// fault handler would: by swapping the page in or filling in a
+// demand-zero page, then, for writes, by breaking copy-on-write sharing.
+static int
+user_mem_fixup(struct Env *env, uintptr_t va, int perm)
+{
+	if (swap_in(env, va) < 0)
+		env_demand_page(env, va, perm & PTE_W);
+	if (perm & PTE_W)
+		env_cow_fault(env, va);
+	return user_mem_perm(env, va, perm) ? 0 : -E_FAULT;
+}
+
 //
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
@@ -595,33 +2469,160 @@ static uintptr_t user_mem_check_addr;
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
+// Each page table is looked up once, and the run of PTEs it holds for
+// the range is checked in one pass.  Demand-zero and copy-on-write
+// pages are made accessible on the way, as a user access would.
+//
+// Only the range below UTOP is the environment's own: above it are the
+// kernel's read-only mappings, and at UVPT its page directory, whose
+// PDEs carry PTE_U and PTE_W, so a range reaching past UTOP always
+// fails.  For the same reason the PDE must give 'perm' as well as the
+// PTE.
+//
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
-    if ((uintptr_t) (va + len) > ULIM) {
-        // not sure what to return here, this is fishy
-        // so are the other returns.
-        // user_mem_check_addr = ULIM;
-        user_mem_check_addr = (uintptr_t) va;
+    uintptr_t start = (uintptr_t) va;
+    uintptr_t last, last_pg, pg;
+    pde_t pde;
+    pte_t *pt;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (start >= UTOP || len > UTOP - start) {
+        user_mem_check_addr = MAX(start, UTOP);
         return -E_FAULT;
     }
-
-    void *scanner;
-    for (scanner = (void*)va; scanner < va + len; scanner++) {
-        pte_t *pte;
-        if (!page_lookup(env->env_pgdir, scanner, &pte)) {
-            // page not mapped
-            user_mem_check_addr = (uintptr_t) scanner;
-            return -E_FAULT;
+    last = start + len - 1;
+    last_pg = ROUNDDOWN(last, PGSIZE);
+    perm |= PTE_P;
+
+    pg = ROUNDDOWN(start, PGSIZE);
+    while (pg <= last_pg) {
+        pde = env->env_pgdir[PDX(pg)];
+        if (pde & PTE_PS) {
+            // A 4MB page: one entry covers the whole run.
+            if ((pde & perm) != perm && user_mem_fixup(env, pg, perm) < 0) {
+                goto fault;
+            }
+            pg = ROUNDDOWN(pg, PTSIZE) + PTSIZE;
+            continue;
         }
-        if (!(*pte & perm)) {
-            user_mem_check_addr = (uintptr_t) scanner;
-            return -E_FAULT;
+        if ((pde & perm) != perm) {
+            // No page table, or not one the user may use this way;
+            // only a demand-zero page can be made accessible here.
+            if (user_mem_fixup(env, pg, perm) < 0) {
+                goto fault;
+            }
+            pg += PGSIZE;
+            continue;
         }
+        // Check the run of PTEs in this page table.
+        pt = (pte_t *) KADDR(PTE_ADDR(pde));
+        do {
+            if ((pt[PTX(pg)] & perm) != perm
+                && user_mem_fixup(env, pg, perm) < 0) {
+                goto fault;
+            }
+            pg += PGSIZE;
+        } while (pg <= last_pg && PTX(pg) != 0);
     }
+	return 0;
+
+fault:
+    user_mem_check_addr = MAX(pg, start);
+    return -E_FAULT;
+}
+
+// Copy 'len' bytes between user address 'uva' in env and kernel buffer
+// 'kbuf', a page at a time through kmap, checking each page's
+// permissions, in its PDE and PTE, as it goes.  Works whichever page
+// directory is loaded.  Writing from a NULL 'kbuf' zeroes the user range.
+// As in user_mem_check, the range must lie below UTOP.
+static int
+user_mem_copy(struct Env *env, uintptr_t uva, void *kbuf, size_t len,
+	      bool to_user)
+{
+	int perm = PTE_U | PTE_P | (to_user ? PTE_W : 0);
+	physaddr_t pa;
+	pte_t *pte;
+	char *kva;
+	size_t n;
 
+	if (len > 0 && (uva >= UTOP || len > UTOP - uva)) {
+		user_mem_check_addr = MAX(uva, UTOP);
+		return -E_FAULT;
+	}
+	while (len > 0) {
+		if (!user_mem_perm(env, uva, perm)
+		    && user_mem_fixup(env, ROUNDDOWN(uva, PGSIZE), perm) < 0)
+			goto fault;
+		pte = pgdir_walk(env->env_pgdir, (void *) uva, 0);
+		if (*pte & PTE_PS)
+			pa = PDE_PS_ADDR(*pte) + (uva & (PTSIZE - 1));
+		else
+			pa = PTE_ADDR(*pte) + PGOFF(uva);
+
+		n = MIN(len, PGSIZE - PGOFF(uva));
+		kva = kmap(pa2page(pa));
+		if (!kbuf)
+			memset(kva + PGOFF(pa), 0, n);
+		else if (to_user)
+			memcpy(kva + PGOFF(pa), kbuf, n);
+		else
+			memcpy(kbuf, kva + PGOFF(pa), n);
+		kunmap(kva);
+		uva += n;
+		if (kbuf)
+			kbuf += n;
+		len -= n;
+	}
 	return 0;
+
+fault:
+	user_mem_check_addr = uva;
+	return -E_FAULT;
+}
+
+//
+// Copy 'len' bytes from user address 'usrc' in environment env into the
+// kernel buffer 'dst', validating the user range as it is copied.
+//
+// Returns 0 on success, -E_FAULT if env may not read the whole range;
+// part of the range may have been copied by then.
+//
+int
+copy_from_user(struct Env *env, void *dst, const void *usrc, size_t len)
+{
+	return user_mem_copy(env, (uintptr_t) usrc, dst, len, 0);
+}
+
+//
+// Copy 'len' bytes from the kernel buffer 'src' to user address 'udst'
+// in environment env, validating the user range as it is copied.
+//
+// Returns 0 on success, -E_FAULT if env may not write the whole range;
+// part of the range may have been written by then.
+//
+int
+copy_to_user(struct Env *env, void *udst, const void *src, size_t len)
+{
+	return user_mem_copy(env, (uintptr_t) udst, (void *) src, len, 1);
+}
+
+//
+// Zero 'len' bytes at user address 'udst' in environment env, validating
+// the user range as it goes.
+//
+// Returns 0 on success, -E_FAULT if env may not write the whole range;
+// part of the range may have been zeroed by then.
+//
+int
+clear_user(struct Env *env, void *udst, size_t len)
+{
+	return user_mem_copy(env, (uintptr_t) udst, NULL, len, 1);
 }
 
 //
@@ -646,59 +2647,138 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // Checking functions.
 // --------------------------------------------------------------
 
+// Count the free pages: those on the buddy free lists, in the per-CPU
+// magazines, in the pre-zeroed pool and in the page-table pool.
+static int
+check_count_free_pages(void)
+{
+	struct PageInfo *pp;
+	int zone, order, i, nfree = page_zero_count + pgtable_pool_count;
+
+	for (zone = 0; zone < NZONES; zone++) {
+		for (order = 0; order <= MAX_ORDER; order++)
+			for (pp = page_free_list[zone][order]; pp; pp = pp->pp_link)
+				nfree += 1 << order;
+		for (i = 0; i < NCPU; i++)
+			nfree += page_mags[i][zone].count;
+	}
+	return nfree;
+}
+
+// Temporarily steal all free memory by allocating every free block,
+// largest first.  The blocks are chained through pp_link, with their
+// order in pp_order.  The magazines and the page pools are drained
+// first so that no free page is left anywhere.  Stealing by allocation
+// (rather than by hiding the free list heads) keeps the buddy allocator
+// from merging freed test pages with stolen blocks.
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *stolen = NULL;
+	int order;
+
+	page_mag_drain_all();
+	spin_lock(&page_lock);
+	page_zero_drain();
+	pgtable_pool_drain();
+	spin_unlock(&page_lock);
+	for (order = MAX_ORDER; order >= 0; order--)
+		while ((pp = page_alloc_order(order, ALLOC_HIGHMEM))) {
+			pp->pp_order = order;
+			pp->pp_link = stolen;
+			stolen = pp;
+		}
+	return stolen;
+}
+
+// Give back the blocks taken by check_steal_free_pages.
+static void
+check_return_free_pages(struct PageInfo *stolen)
+{
+	struct PageInfo *pp;
+
+	while ((pp = stolen)) {
+		stolen = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free_order(pp, pp->pp_order);
+	}
+}
+
 //
 // Check that the pages on the page_free_list are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *block;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
-	char *first_free_page;
+	physaddr_t first_free_page;
+	int zone, order, i;
 
-	if (!page_free_list)
+	if (!check_count_free_pages())
 		panic("'page_free_list' is a null pointer!");
 
 	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
+		// Move blocks with lower addresses first in each free
 		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+		// (Blocks never straddle a 4MB boundary.)
+		for (order = 0; order <= MAX_ORDER; order++) {
+			struct PageInfo *pp1, *pp2, *prev;
+			struct PageInfo **tp[2] = { &pp1, &pp2 };
+			for (pp = page_free_list[ZONE_NORMAL][order]; pp; pp = pp->pp_link) {
+				int pagetype = PDX(page2pa(pp)) >= pdx_limit;
+				*tp[pagetype] = pp;
+				tp[pagetype] = &pp->pp_link;
+			}
+			*tp[1] = 0;
+			*tp[0] = pp2;
+			page_free_list[ZONE_NORMAL][order] = pp1;
+			for (prev = NULL, pp = pp1; pp; prev = pp, pp = pp->pp_link)
+				pp->pp_prev = prev;
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
-
-	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	// (Highmem pages have no kernel address to scribble through.)
+	for (order = 0; order <= MAX_ORDER; order++)
+		for (block = page_free_list[ZONE_NORMAL][order]; block; block = block->pp_link)
+			for (i = 0; i < (1 << order); i++)
+				if (PDX(page2pa(block + i)) < pdx_limit)
+					memset(page2kva(block + i), 0x97, 128);
+
+	first_free_page = PADDR(boot_alloc(0));
+	for (zone = 0; zone < NZONES; zone++) {
+		for (order = 0; order <= MAX_ORDER; order++)
+			for (block = page_free_list[zone][order]; block; block = block->pp_link) {
+				// check that we didn't corrupt the free list itself
+				assert(block >= pages);
+				assert(block + (1 << order) <= pages + npages);
+				assert(((char *) block - (char *) pages) % sizeof(*block) == 0);
+				assert(((block - pages) & ((1 << order) - 1)) == 0);
+				assert(block->pp_flags & PP_FREE);
+				assert(block->pp_order == order);
+				assert(!block->pp_link || block->pp_link->pp_prev == block);
+				assert(page_zone(block) == zone);
+				assert(page_zone(block + (1 << order) - 1) == zone);
+	
+				for (i = 0; i < (1 << order); i++) {
+					pp = block + i;
+	
+					// check a few pages that shouldn't be on the free list
+					assert(page2pa(pp) != 0);
+					assert(page2pa(pp) != IOPHYSMEM);
+					assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+					assert(page2pa(pp) != EXTPHYSMEM);
+					assert(page2pa(pp) < EXTPHYSMEM || page2pa(pp) >= first_free_page);
+	
+					if (page2pa(pp) < EXTPHYSMEM)
+						++nfree_basemem;
+					else
+						++nfree_extmem;
+				}
+			}
 	}
 
 	assert(nfree_basemem > 0);
@@ -713,6 +2793,7 @@ static void
 check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
+	struct PageInfo **free_list = page_free_list[ZONE_NORMAL];
 	int nfree;
 	struct PageInfo *fl;
 	char *c;
@@ -722,8 +2803,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_count_free_pages();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -739,8 +2819,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -768,7 +2847,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -776,9 +2855,50 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(check_count_free_pages() == nfree);
+
+	// blocks are naturally aligned
+	assert((pp = page_alloc_order(3, 0)));
+	assert((page2pa(pp) & ((PGSIZE << 3) - 1)) == 0);
+
+	// with nothing else free, splitting an order-3 block leaves one
+	// free block each of order 0, 1 and 2 (single pages are taken from
+	// the buddy allocator directly, bypassing the magazines)
+	fl = check_steal_free_pages();
+	page_free_order(pp, 3);
+	assert((pp0 = page_alloc_order(0, 0)) == pp);
+	assert(free_list[0] == pp + 1);
+	assert(free_list[1] == pp + 2);
+	assert(free_list[2] == pp + 4);
+	assert(!free_list[3]);
+
+	// an order-2 request is served without splitting; no second one fits
+	assert((pp1 = page_alloc_order(2, 0)) == pp + 4);
+	assert(!page_alloc_order(2, 0));
+
+	// freeing pp0 merges it with its free buddies, up to order 2 ...
+	page_free_order(pp0, 0);
+	assert(!free_list[0] && !free_list[1]);
+	assert(free_list[2] == pp && !free_list[2]->pp_link);
+
+	// ... and freeing pp1 completes the original order-3 block
+	page_free_order(pp1, 2);
+	assert(!free_list[2]);
+	assert(free_list[3] == pp && !free_list[3]->pp_link);
+	assert(check_count_free_pages() == 8);
+
+	// a freed page whose buddy is still in use does not merge
+	assert((pp0 = page_alloc_order(0, 0)) == pp);
+	assert((pp1 = page_alloc_order(0, 0)) == pp + 1);
+	page_free_order(pp0, 0);
+	assert(free_list[0] == pp0 && free_list[1] == pp + 2);
+	page_free_order(pp1, 0);
+	assert(!free_list[0] && free_list[3] == pp);
+
+	assert(page_alloc_order(3, 0) == pp);
+	check_return_free_pages(fl);
+	page_free_order(pp, 3);
+	assert(check_count_free_pages() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -809,14 +2929,29 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
-	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	// check phys mem, up to the start of highmem
+	for (i = 0; i < MIN(npages * PGSIZE, HIGHMEM_START); i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
-	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
+	// check kernel stacks, and the guards below them
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
+	assert(*pgdir_walk(pgdir, (void *) (KSTACKTOP - PGSIZE), 0) & PTE_G);
+
+	// the UVPT mapping differs between address spaces, so is not global
+	assert(!(pgdir[PDX(UVPT)] & PTE_G));
+
+	// the kmap area starts out empty
+	assert(kmap_ptes == pgdir_walk(pgdir, (void *) KMAPBASE, 0));
+	for (i = 0; i < KMAPSIZE; i += PGSIZE)
+		assert(check_va2pa(pgdir, KMAPBASE + i) == ~0);
+	assert(KMAPBASE + KMAPSIZE <= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
 
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
@@ -831,6 +2966,7 @@ check_kern_pgdir(void)
 			if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
 				assert(pgdir[i] & PTE_W);
+				assert(!pse_enabled || (pgdir[i] & (PTE_PS|PTE_G)) == (PTE_PS|PTE_G));
 			} else
 				assert(pgdir[i] == 0);
 			break;
@@ -852,6 +2988,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_PS_ADDR(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -881,8 +3019,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1002,7 +3139,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1017,9 +3154,12 @@ static void
 check_page_installed_pgdir(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct PageInfo *fl, *ppv[3];
+	struct tlb_gather tg;
 	pte_t *ptep, *ptep1;
 	uintptr_t va;
+	uint32_t hits;
+	char *c;
 	int i;
 
 	// check that we can read and write installed pages
@@ -1051,5 +3191,189 @@ check_page_installed_pgdir(void)
 	// free the pages we took
 	page_free(pp0);
 
+	// map a run of pages across a page table boundary in one call
+	va = 2 * PTSIZE - PGSIZE;
+	assert((ppv[0] = pp0 = page_alloc(0)));
+	assert((ppv[1] = pp1 = page_alloc(0)));
+	assert((ppv[2] = pp2 = page_alloc(0)));
+	memset(page2kva(pp2), 2, PGSIZE);
+	assert(page_insert_range(kern_pgdir, ppv, 3, (void *) va, PTE_W) == 0);
+	assert(pp0->pp_ref == 1 && pp1->pp_ref == 1 && pp2->pp_ref == 1);
+	assert(check_va2pa(kern_pgdir, va) == page2pa(pp0));
+	assert(check_va2pa(kern_pgdir, va + PGSIZE) == page2pa(pp1));
+	assert(*(uint32_t *) (va + 2 * PGSIZE) == 0x02020202U);
+
+	// mapping over a run replaces the old pages, freeing pp0
+	ppv[0] = pp1;
+	assert(page_insert_range(kern_pgdir, ppv, 1, (void *) va, PTE_W) == 0);
+	assert(pp0->pp_ref == 0 && pp1->pp_ref == 2);
+	assert(check_va2pa(kern_pgdir, va) == page2pa(pp1));
+
+	// the reverse map finds both of pp1's mappings
+	assert(pp0->pp_rmap == 0 && rmap_count(pp1) == 2);
+	assert(rmap_count(pp2) == 1
+	       && pp2->pp_rmap == (uintptr_t) pgdir_walk(kern_pgdir, (void *) (va + 2 * PGSIZE), 0));
+
+	// removing the run frees its pages and puts the emptied page
+	// tables in the pool, from which the next page table comes
+	i = pgtable_pool_count;
+	pp0 = pa2page(PTE_ADDR(kern_pgdir[PDX(va + PGSIZE)]));
+	assert(pp0->pp_ptcount == 2);
+	page_remove_range(kern_pgdir, (void *) va, 3 * PGSIZE);
+	assert(pp1->pp_ref == 0 && pp2->pp_ref == 0);
+	assert(pp1->pp_rmap == 0 && pp2->pp_rmap == 0);
+	assert(!kern_pgdir[PDX(va)] && !kern_pgdir[PDX(va + PGSIZE)]);
+	assert(pgtable_pool_count == MIN(i + 2, PGTABLE_POOL_MAX));
+	assert(pgtable_alloc() == pp0 && pp0->pp_ptcount == 0);
+	pgtable_free(pp0);
+
+	// migrating a page moves its contents and all its mappings
+	assert((pp0 = page_alloc(0)) && (pp1 = page_alloc(0)));
+	memset(page2kva(pp0), 4, PGSIZE);
+	assert(page_insert(kern_pgdir, pp0, (void *) va, PTE_W) == 0);
+	assert(page_insert(kern_pgdir, pp0, (void *) (va + PGSIZE), PTE_W) == 0);
+	assert(page_movable(pp0) && !page_movable(pp1));
+	page_unmap(pp0);
+	assert(check_va2pa(kern_pgdir, va) == ~0);
+	tlb_flush_all();
+	page_migrate(pp0, pp1);
+	assert(pp0->pp_ref == 0 && pp0->pp_rmap == 0 && !page_movable(pp0));
+	assert(pp1->pp_ref == 2 && rmap_count(pp1) == 2);
+	assert(check_va2pa(kern_pgdir, va) == page2pa(pp1));
+	assert(check_va2pa(kern_pgdir, va + PGSIZE) == page2pa(pp1));
+	assert(*(uint32_t *) (va + PGSIZE) == 0x04040404U);
+	assert(*pgdir_walk(kern_pgdir, (void *) va, 0) & PTE_W);
+	page_free(pp0);
+	page_remove_range(kern_pgdir, (void *) va, 2 * PGSIZE);
+	assert(pp1->pp_ref == 0);
+
+	// merging identical pages leaves one, shared copy-on-write
+	assert((pp0 = page_alloc(0)) && (pp1 = page_alloc(0)));
+	memset(page2kva(pp0), 6, PGSIZE);
+	memset(page2kva(pp1), 6, PGSIZE);
+	assert(page_insert(kern_pgdir, pp0, (void *) va, PTE_W) == 0);
+	assert(page_insert(kern_pgdir, pp1, (void *) (va + PGSIZE), PTE_W) == 0);
+	assert(page_merge(pp1, pp0) == 0);
+	tlbflush();
+	assert(pp1->pp_ref == 0 && pp1->pp_rmap == 0);
+	assert(pp0->pp_ref == 2 && rmap_count(pp0) == 2);
+	assert(check_va2pa(kern_pgdir, va + PGSIZE) == page2pa(pp0));
+	assert((*pgdir_walk(kern_pgdir, (void *) va, 0) & (PTE_W | PTE_COW)) == PTE_COW);
+	assert((*pgdir_walk(kern_pgdir, (void *) (va + PGSIZE), 0) & (PTE_W | PTE_COW)) == PTE_COW);
+	page_remove_range(kern_pgdir, (void *) va, 2 * PGSIZE);
+	assert(pp0->pp_ref == 0);
+
+	// a 4MB user page takes one page directory entry, replacing the
+	// page table there, and is unmapped and freed as a whole
+	if (pse_enabled) {
+		va = 2 * PTSIZE;
+		assert((pp0 = page_alloc(0)));
+		assert(page_insert(kern_pgdir, pp0, (void *) va, PTE_W) == 0);
+		assert((pp = page_alloc_order(MAX_ORDER, 0)));
+		assert(page_insert_large(kern_pgdir, pp, (void *) va, PTE_W) == 0);
+		assert(pp0->pp_ref == 0 && pp0->pp_rmap == 0);
+		assert(pp->pp_flags & PP_LARGE);
+		assert(kern_pgdir[PDX(va)] & PTE_PS);
+		assert(check_va2pa(kern_pgdir, va + 5 * PGSIZE) == page2pa(pp + 5));
+		assert(page_lookup(kern_pgdir, (void *) (va + 5 * PGSIZE), NULL) == pp);
+		assert(pp->pp_ref == 1 && rmap_count(pp) == 1 && !page_movable(pp));
+		*(uint32_t *) (va + PTSIZE - 4) = 0x05050505U;
+		page_remove(kern_pgdir, (void *) (va + 5 * PGSIZE));
+		assert(!kern_pgdir[PDX(va)] && pp->pp_ref == 0 && pp->pp_rmap == 0);
+		assert(!(pp->pp_flags & PP_LARGE));
+		va = 2 * PTSIZE - PGSIZE;
+	}
+
+	// a gather drops user addresses of a page directory that is not
+	// loaded, but keeps kernel addresses, which every one shares
+	assert((pp0 = page_alloc(ALLOC_ZERO)));
+	tlb_gather_init(&tg, page2kva(pp0));
+	tlb_gather_add(&tg, va);
+	assert(tg.n == 0);
+	tlb_gather_add(&tg, KMAPBASE);
+	assert(tg.n == 1 && tg.kernel);
+	tlb_gather_finish(&tg);
+	assert(tg.n == 0);
+	tlb_gather_init(&tg, kern_pgdir);
+	tlb_gather_add(&tg, va);
+	assert(tg.n == 1 && !tg.kernel);
+	tlb_gather_finish(&tg);
+	page_free(pp0);
+
+	// an idle pass fills the pre-zeroed pool, which then serves
+	// ALLOC_ZERO without touching the page again ...
+	page_zero_idle();
+	assert(page_zero_count > 0);
+	i = page_zero_count;
+	assert((pp = page_alloc(0)) && !(pp->pp_flags & PP_ZERO));
+	assert(page_zero_count == i);
+	page_free(pp);
+	pp = page_zero_list;
+	assert(pp->pp_flags & PP_ZERO);
+	hits = zero_stats.hits;
+	assert((pp0 = page_alloc(ALLOC_ZERO)) == pp);
+	assert(zero_stats.hits == hits + 1);
+	assert(!(pp0->pp_flags & PP_ZERO) && !pp0->pp_link);
+	assert(page_zero_count == i - 1);
+	c = page2kva(pp0);
+	for (i = 0; i < PGSIZE; i++)
+		assert(c[i] == 0);
+
+	// ... and freed pages count as dirty again
+	memset(c, 0x5a, PGSIZE);
+	page_free(pp0);
+	assert(!(pp0->pp_flags & PP_ZERO));
+	spin_lock(&page_lock);
+	page_zero_drain();
+	spin_unlock(&page_lock);
+	assert(page_zero_count == 0);
+
+	// a freed page sits on top of this CPU's magazine and is the next
+	// one handed out; a full magazine drains to the buddy allocator
+	assert((pp = page_alloc(0)) == pp0);
+	page_free(pp);
+	fl = NULL;
+	for (i = 0; i < PAGE_MAG_SIZE + 1; i++) {
+		assert((pp = page_alloc(0)));
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	assert(page_mags[cpunum()][ZONE_NORMAL].count <= PAGE_MAG_SIZE);
+	assert(page_mags[cpunum()][ZONE_NORMAL].count > PAGE_MAG_SIZE - PAGE_MAG_BATCH);
+
+	// kmap returns a lowmem page's KERNBASE address, and maps a highmem
+	// page (if the machine has any) at a kmap slot until kunmap
+	assert((pp0 = page_alloc(0)));
+	assert(kmap(pp0) == page2kva(pp0));
+	kunmap(page2kva(pp0));
+	page_free(pp0);
+	assert((pp0 = page_alloc(ALLOC_HIGHMEM | ALLOC_ZERO)));
+	assert(page_is_highmem(pp0) == (npages > PGNUM(HIGHMEM_START)));
+	c = kmap(pp0);
+	assert(c[0] == 0 && c[PGSIZE - 1] == 0);
+	c[1] = 7;
+	kunmap(c);
+	if (page_is_highmem(pp0)) {
+		assert(KMAPBASE <= (uintptr_t) c && (uintptr_t) c < KMAPBASE + KMAPSIZE);
+		assert(check_va2pa(kern_pgdir, (uintptr_t) c) == ~0);
+	}
+	c = kmap(pp0);
+	assert(c[1] == 7);
+	kunmap(c);
+	// kmap comes back around to the first slot once it runs out
+	for (i = 0; page_is_highmem(pp0) && i <= NKMAP; i++) {
+		c = kmap(pp0);
+		assert(c[1] == 7);
+		kunmap(c);
+		if (i == NKMAP)
+			assert((uintptr_t) c < KMAPBASE + NKMAP / 2 * PGSIZE);
+	}
+	page_free(pp0);
+
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
@@ -17,9 +17,16 @@ extern size_t npages;
 
 extern pde_t *kern_pgdir;
 
+// A zeroed page shared, read-only, by every mapping of memory that has
+// not been written yet.  It holds one reference of its own, so it is
+// never freed, migrated or swapped out.  ZERO_PAGE_MAXREF keeps its
+// reference count from overflowing.
+extern struct PageInfo *zero_page;
+#define ZERO_PAGE_MAXREF	0xF000
+
 
 /* This macro takes a kernel virtual address -- an address that points above
- * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
+ * KERNBASE, where the first 256MB of physical memory is mapped --
  * and returns the corresponding physical address.  It panics if you pass it a
  * non-kernel virtual address.
  */
@@ -33,14 +40,19 @@ _paddr(const char *file, int line, void *kva)
 	return (physaddr_t)kva - KERNBASE;
 }
 
+// Physical memory from here up is highmem.  It lies beyond the KERNBASE
+// mapping, so the kernel reaches its contents only through kmap.
+#define HIGHMEM_START	((physaddr_t) -KERNBASE)
+
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address,
+ * including one in highmem. */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages || pa >= HIGHMEM_START)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *)(pa + KERNBASE);
 }
@@ -49,22 +61,78 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// The page may come from highmem, which is preferred if any is
+	// free.  Use for pages the kernel does not need to keep mapped,
+	// such as user memory.
+	ALLOC_HIGHMEM = 1<<1,
 };
 
+// The buddy allocator hands out naturally aligned blocks of 2^order
+// pages, up to 2^MAX_ORDER pages (one PTSIZE superpage).
+#define MAX_ORDER	10
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_zero_idle(void);
+int	page_compact(int order, int alloc_flags);
+bool	page_movable(struct PageInfo *pp);
+int	page_merge(struct PageInfo *pp, struct PageInfo *kp);
+bool	page_wrprotect(struct PageInfo *pp);
+void	page_print_stats(void);
+void	page_bench(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_range(pde_t *pgdir, struct PageInfo **pps, size_t n,
+			  void *va, int perm);
+int	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_zero(pde_t *pgdir, void *va, int perm);
+void *	mmio_map_region(physaddr_t pa, size_t size);
 void	page_remove(pde_t *pgdir, void *va);
+void	page_remove_range(pde_t *pgdir, void *va, size_t size);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+struct PageInfo *pgtable_alloc(void);
+void	pgtable_free(struct PageInfo *pp);
+
+void *	kmap(struct PageInfo *pp);
+void	kunmap(void *kva);
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_shootdown_recv(void);
+void	tlb_flush_all(void);
+void	tlb_bench(void);
+void	tlb_print_stats(void);
+
+// A tlb_gather collects the TLB invalidations one operation on a page
+// directory needs, so they can be done together (see tlb_gather_finish).
+#define TLB_GATHER_MAX	64
+
+struct tlb_gather {
+	pde_t *pgdir;			// Page directory being changed
+	size_t n;			// Stale pages gathered
+	bool kernel;			// Some are above UTOP
+	bool remote;			// Other CPUs may have some cached
+	uintptr_t va[TLB_GATHER_MAX];	// Their addresses, while n fits
+};
+
+extern size_t tlb_flush_threshold;
+
+void	tlb_gather_init(struct tlb_gather *tg, pde_t *pgdir);
+void	tlb_gather_add(struct tlb_gather *tg, uintptr_t va);
+void	tlb_gather_finish(struct tlb_gather *tg);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	copy_from_user(struct Env *env, void *dst, const void *usrc, size_t len);
+int	copy_to_user(struct Env *env, void *udst, const void *src, size_t len);
+int	clear_user(struct Env *env, void *udst, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -80,6 +148,12 @@ pa2page(physaddr_t pa)
 	return &pages[PGNUM(pa)];
 }
 
+static inline bool
+page_is_highmem(struct PageInfo *pp)
+{
+	return page2pa(pp) >= HIGHMEM_START;
+}
+
 static inline void*
 page2kva(struct PageInfo *pp)
 {
@@ -0,0 +1,285 @@
+/* See COPYRIGHT for copyright information. */
+
+// Reverse maps (see kern/rmap.h).
+//
+// A page's pp_rmap is 0 if the page is not mapped, the address of the
+// one PTE that maps it, or the address of its first struct rmap_chain
+// tagged with RMAP_CHAIN.  PTEs are 4-byte aligned and chains come from
+// a slab cache, so the low bit is free for the tag.  A page keeps its
+// chain until only one mapping is left, when the chain is given back
+// and the last PTE pointer moves inline again.
+//
+// Reverse maps are not locked; like the page tables they describe,
+// callers must serialize changes to them.
+
+#include <inc/types.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/rmap.h>
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+
+#define RMAP_CHAIN	0x1	// pp_rmap points to a struct rmap_chain
+#define RMAP_CHAIN_NPTE	7	// PTE pointers per chain block
+
+struct rmap_chain {
+	struct rmap_chain *next;
+	pte_t *ptes[RMAP_CHAIN_NPTE];	// NULL for unused slots
+};
+
+static struct kmem_cache *rmap_chain_cache;
+
+static void check_rmap(void);
+
+static struct rmap_chain *
+rmap_chain(struct PageInfo *pp)
+{
+	return (pp->pp_rmap & RMAP_CHAIN)
+		? (struct rmap_chain *) (pp->pp_rmap & ~RMAP_CHAIN) : NULL;
+}
+
+static struct rmap_chain *
+rmap_chain_alloc(void)
+{
+	struct rmap_chain *c;
+
+	if ((c = kmem_cache_alloc(rmap_chain_cache)))
+		memset(c, 0, sizeof(*c));
+	return c;
+}
+
+void
+rmap_init(void)
+{
+	struct rmap_chain *c;
+
+	if (!(rmap_chain_cache = kmem_cache_create("rmap_chain",
+						   sizeof(struct rmap_chain),
+						   0, NULL)))
+		panic("rmap_init: cannot create rmap_chain cache");
+
+	// Allocating and freeing one chain leaves an empty slab cached,
+	// so the first pages shared do not depend on a free page.
+	if (!(c = rmap_chain_alloc()))
+		panic("rmap_init: out of memory");
+	kmem_cache_free(rmap_chain_cache, c);
+
+	check_rmap();
+}
+
+//
+// Record that the PTE at 'ptep' maps page 'pp'.  The same PTE may be
+// recorded more than once, as page_insert does briefly when a page is
+// mapped again where it already is; each rmap_add needs an rmap_remove.
+//
+// Returns 0 on success, -E_NO_MEM if a chain block couldn't be
+// allocated.  A page's first mapping never needs one.
+//
+int
+rmap_add(struct PageInfo *pp, pte_t *ptep)
+{
+	struct rmap_chain *c, *head;
+	int i;
+
+	assert(ptep && ((uintptr_t) ptep & RMAP_CHAIN) == 0);
+	if (pp->pp_rmap == 0) {
+		pp->pp_rmap = (uintptr_t) ptep;
+		return 0;
+	}
+
+	if (!(head = rmap_chain(pp))) {
+		// Second mapping: move the inline PTE into a chain.
+		if (!(c = rmap_chain_alloc()))
+			return -E_NO_MEM;
+		c->ptes[0] = (pte_t *) pp->pp_rmap;
+		c->ptes[1] = ptep;
+		pp->pp_rmap = (uintptr_t) c | RMAP_CHAIN;
+		return 0;
+	}
+
+	for (c = head; c; c = c->next)
+		for (i = 0; i < RMAP_CHAIN_NPTE; i++)
+			if (!c->ptes[i]) {
+				c->ptes[i] = ptep;
+				return 0;
+			}
+
+	if (!(c = rmap_chain_alloc()))
+		return -E_NO_MEM;
+	c->ptes[0] = ptep;
+	c->next = head;
+	pp->pp_rmap = (uintptr_t) c | RMAP_CHAIN;
+	return 0;
+}
+
+//
+// Forget one record that the PTE at 'ptep' maps page 'pp'.
+// Panics if there is none.
+//
+void
+rmap_remove(struct PageInfo *pp, pte_t *ptep)
+{
+	struct rmap_chain *c, **cp, *head;
+	pte_t *last = NULL;
+	int i, n;
+
+	if (!(head = rmap_chain(pp))) {
+		if (pp->pp_rmap != (uintptr_t) ptep)
+			panic("rmap_remove: pte %08x does not map pa %08x",
+			      ptep, page2pa(pp));
+		pp->pp_rmap = 0;
+		return;
+	}
+
+	for (cp = &head; (c = *cp); cp = &c->next)
+		for (i = 0; i < RMAP_CHAIN_NPTE; i++)
+			if (c->ptes[i] == ptep)
+				goto found;
+	panic("rmap_remove: pte %08x does not map pa %08x", ptep, page2pa(pp));
+
+found:
+	c->ptes[i] = NULL;
+	for (i = 0; i < RMAP_CHAIN_NPTE && !c->ptes[i]; i++)
+		/* do nothing */;
+	if (i == RMAP_CHAIN_NPTE) {
+		*cp = c->next;
+		kmem_cache_free(rmap_chain_cache, c);
+	}
+
+	// Back to a single mapping: store it inline again.
+	if (head && !head->next) {
+		for (i = n = 0; i < RMAP_CHAIN_NPTE; i++)
+			if (head->ptes[i]) {
+				last = head->ptes[i];
+				n++;
+			}
+		if (n == 1) {
+			kmem_cache_free(rmap_chain_cache, head);
+			pp->pp_rmap = (uintptr_t) last;
+			return;
+		}
+	}
+	pp->pp_rmap = head ? (uintptr_t) head | RMAP_CHAIN : 0;
+}
+
+//
+// Call fn(ptep, arg) for each PTE that maps page 'pp', stopping early if
+// fn returns non-zero.  fn may change the PTE but must not add to or
+// remove from pp's reverse map.
+//
+// Returns the last value fn returned, or 0 if pp is not mapped.
+//
+int
+rmap_walk(struct PageInfo *pp, int (*fn)(pte_t *ptep, void *arg), void *arg)
+{
+	struct rmap_chain *c;
+	int i, r;
+
+	if (pp->pp_rmap == 0)
+		return 0;
+	if (!(c = rmap_chain(pp)))
+		return fn((pte_t *) pp->pp_rmap, arg);
+
+	for (r = 0; c; c = c->next)
+		for (i = 0; i < RMAP_CHAIN_NPTE; i++)
+			if (c->ptes[i] && (r = fn(c->ptes[i], arg)) != 0)
+				return r;
+	return r;
+}
+
+//
+// Forget every PTE that maps page 'pp', once the caller has pointed them
+// all elsewhere.
+//
+void
+rmap_clear(struct PageInfo *pp)
+{
+	struct rmap_chain *c, *next;
+
+	for (c = rmap_chain(pp); c; c = next) {
+		next = c->next;
+		kmem_cache_free(rmap_chain_cache, c);
+	}
+	pp->pp_rmap = 0;
+}
+
+// Returns the number of PTEs that map page 'pp'.
+int
+rmap_count(struct PageInfo *pp)
+{
+	struct rmap_chain *c;
+	int i, n;
+
+	if (pp->pp_rmap == 0)
+		return 0;
+	if (!(c = rmap_chain(pp)))
+		return 1;
+	for (n = 0; c; c = c->next)
+		for (i = 0; i < RMAP_CHAIN_NPTE; i++)
+			n += c->ptes[i] != NULL;
+	return n;
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static int
+check_rmap_mark(pte_t *ptep, void *arg)
+{
+	*ptep |= PTE_A;
+	return 0;
+}
+
+static void
+check_rmap(void)
+{
+	struct PageInfo page;
+	pte_t ptes[20];
+	int i;
+
+	memset(&page, 0, sizeof(page));
+	memset(ptes, 0, sizeof(ptes));
+
+	// a single mapping is kept inline
+	assert(rmap_add(&page, &ptes[0]) == 0);
+	assert(page.pp_rmap == (uintptr_t) &ptes[0]);
+	assert(rmap_count(&page) == 1);
+
+	// more mappings spill into chains, over several blocks
+	for (i = 1; i < 20; i++)
+		assert(rmap_add(&page, &ptes[i]) == 0);
+	assert(page.pp_rmap & RMAP_CHAIN);
+	assert(rmap_count(&page) == 20);
+	rmap_walk(&page, check_rmap_mark, NULL);
+	for (i = 0; i < 20; i++)
+		assert(ptes[i] == PTE_A);
+
+	// removing all but one goes back to inline
+	for (i = 19; i > 7; i--)
+		rmap_remove(&page, &ptes[i]);
+	assert(rmap_count(&page) == 8);
+	for (i = 0; i < 7; i++)
+		rmap_remove(&page, &ptes[i]);
+	assert(page.pp_rmap == (uintptr_t) &ptes[7]);
+
+	// a duplicate record needs its own removal
+	assert(rmap_add(&page, &ptes[7]) == 0);
+	assert(rmap_count(&page) == 2);
+	rmap_remove(&page, &ptes[7]);
+	assert(page.pp_rmap == (uintptr_t) &ptes[7]);
+	rmap_remove(&page, &ptes[7]);
+	assert(page.pp_rmap == 0 && rmap_count(&page) == 0);
+
+	// clearing drops the chain all at once
+	for (i = 0; i < 20; i++)
+		assert(rmap_add(&page, &ptes[i]) == 0);
+	rmap_clear(&page);
+	assert(page.pp_rmap == 0 && rmap_count(&page) == 0);
+
+	cprintf("check_rmap() succeeded!\n");
+}
@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_RMAP_H
+#define JOS_KERN_RMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+// Reverse maps: for each physical page, the page table entries that map
+// it.  page_insert, page_remove and friends keep them up to date for
+// every reference-counted mapping; the static mappings made by
+// boot_map_region and kmap are not tracked.
+//
+// A page mapped once keeps its only PTE pointer inline in its PageInfo.
+// A shared page chains blocks of PTE pointers from the rmap_chain cache.
+
+void	rmap_init(void);
+int	rmap_add(struct PageInfo *pp, pte_t *ptep);
+void	rmap_remove(struct PageInfo *pp, pte_t *ptep);
+void	rmap_clear(struct PageInfo *pp);
+int	rmap_walk(struct PageInfo *pp, int (*fn)(pte_t *ptep, void *arg),
+		  void *arg);
+int	rmap_count(struct PageInfo *pp);
+
+#endif	// !JOS_KERN_RMAP_H
@@ -0,0 +1,510 @@
+/* See COPYRIGHT for copyright information. */
+
+// Multi-level feedback queue scheduling (see kern/sched.h).
+//
+// The environments that are ENV_RUNNABLE, other than the ones running,
+// wait on the run queue of their level, threaded through their struct
+// Envs in the order they will run.  env_run takes the environment it
+// runs off its queue and puts the one it replaces back at the tail of
+// its own, so the queues stay in step with env_status without
+// sched_yield ever scanning envs[].
+//
+// Each CPU has its own set of run queues, in a struct RunQueue.  An
+// environment goes back on the queues of the CPU it last ran on, so it
+// finds its cache warm there; a new one goes on those of the CPU with
+// the fewest environments.  A CPU with nothing of its own to run takes
+// the first environment waiting on another CPU's queues, highest level
+// first, before it halts.
+//
+// An environment's time slice is only refilled when it changes level, so
+// one that gives up the CPU just before each tick still runs out of
+// slice eventually, and moves down like any other.
+//
+// Priority boosts are lazy for environments that are not runnable:
+// boost_epoch counts the boosts, and an environment whose env_epoch is
+// behind goes back to the level of its priority when next enqueued.
+//
+// Deadline environments are not on the run queues but on dl_list, which
+// sched_yield searches for the earliest deadline before looking at the
+// queues; there are few enough of them that a list does.  Each tick is
+// charged to the running job's budget.  A job that runs out of budget,
+// or whose environment yields, is complete, and the environment waits
+// for its next release.  A job still incomplete when it falls due is
+// counted as a miss and abandoned, so that a late job cannot make the
+// jobs of other environments late too.
+//
+// Deadline environments only run on the boot CPU.  Its ticks are the
+// ones that release their jobs, and admission only has the one CPU's
+// time to share out among them; spreading them over the other CPUs too
+// would need a run queue and an admission test per CPU.  The other CPUs
+// never pick a deadline environment, and give up one still running there
+// when it became a deadline environment.  A deadline environment only
+// runs jobs: between them it waits, even if the CPU would be idle.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/ksm.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+volatile uint32_t ticks;
+
+// One CPU's run queues
+struct RunQueue {
+	struct {
+		struct Env *head, *tail;
+	} level[SCHED_NLEVELS];
+	int nqueued;		// Environments on them
+	uint32_t steals;	// Environments this CPU took from others
+} __attribute__((aligned(CACHELINE)));
+
+static struct RunQueue runqs[NCPU];
+
+static uint32_t boost_epoch;	// Priority boosts so far
+
+static struct Env *dl_list;	// Environments with deadlines
+static uint32_t dl_bw;		// Share of the CPU they were promised
+
+static void sched_halt(void) __attribute__((noreturn));
+
+static bool
+sched_queued(struct Env *e)
+{
+	return e->env_rq_prev || runqs[e->env_cpu].level[e->env_level].head == e;
+}
+
+// Returns the CPU a new environment should wait on: the one with the
+// fewest environments queued or running.
+static int
+sched_place(void)
+{
+	int i, n, best = 0, best_n = -1;
+
+	for (i = 0; i < ncpu; i++) {
+		n = runqs[i].nqueued + (cpus[i].cpu_env != NULL);
+		if (best_n < 0 || n < best_n) {
+			best = i;
+			best_n = n;
+		}
+	}
+	return best;
+}
+
+// Move e to level 'level', with a full time slice.
+static void
+sched_set_level(struct Env *e, int level)
+{
+	e->env_level = level;
+	e->env_slice = SCHED_QUANTUM(level);
+}
+
+// Put runnable environment e at the tail of the run queue for its level,
+// on the CPU it last ran on.  Deadline environments only start waiting.
+void
+sched_enqueue(struct Env *e)
+{
+	struct RunQueue *rq;
+
+	if (e->env_dl_period) {
+		assert(e->env_status == ENV_RUNNABLE);
+		e->env_stamp = read_tsc();
+		return;
+	}
+	assert(e->env_status == ENV_RUNNABLE && !sched_queued(e));
+	if (e->env_epoch != boost_epoch) {
+		sched_set_level(e, e->env_priority);
+		e->env_epoch = boost_epoch;
+	}
+	if (e->env_runs == 0)
+		e->env_cpu = sched_place();
+
+	rq = &runqs[e->env_cpu];
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->level[e->env_level].tail;
+	if (rq->level[e->env_level].tail)
+		rq->level[e->env_level].tail->env_rq_next = e;
+	else
+		rq->level[e->env_level].head = e;
+	rq->level[e->env_level].tail = e;
+	rq->nqueued++;
+	e->env_stamp = read_tsc();
+}
+
+// Take environment e off its run queue, if it is on one.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq = &runqs[e->env_cpu];
+
+	if (e->env_dl_period) {
+		if (e->env_status == ENV_RUNNABLE)
+			e->env_waittime += read_tsc() - e->env_stamp;
+		return;
+	}
+	if (!sched_queued(e))
+		return;
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->level[e->env_level].head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->level[e->env_level].tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	rq->nqueued--;
+	e->env_waittime += read_tsc() - e->env_stamp;
+}
+
+// Set the priority of environment e, and move it to that level.
+void
+sched_set_priority(struct Env *e, int priority)
+{
+	bool queued = sched_queued(e);
+
+	assert(priority >= 0 && priority < SCHED_NLEVELS);
+	if (queued)
+		sched_dequeue(e);
+	e->env_priority = priority;
+	e->env_epoch = boost_epoch;
+	sched_set_level(e, priority);
+	if (queued)
+		sched_enqueue(e);
+}
+
+// Environment e is giving up the CPU before its time slice is out, as an
+// interactive one waiting for input does: move it up a level.  If e has
+// deadlines, its current job is complete.
+void
+sched_relinquish(struct Env *e)
+{
+	if (e->env_dl_period)
+		e->env_dl_budget = 0;
+	else if (e->env_level > e->env_priority)
+		sched_set_level(e, e->env_level - 1);
+}
+
+// The share of the CPU, out of SCHED_DL_BW_ONE, that 'runtime' ticks
+// every 'period' ticks takes, rounded up.
+static uint32_t
+sched_dl_bw(uint32_t runtime, uint32_t period)
+{
+	if (period == 0)
+		return 0;
+	return ROUNDUP(runtime * SCHED_DL_BW_ONE, period) / period;
+}
+
+//
+// Give environment e deadline jobs of 'runtime' ticks every 'period'
+// ticks, each due 'deadline' ticks after its release, with its first job
+// released now.  A period of 0 makes e best-effort again.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL unless 0 < runtime <= deadline <= period.
+//	-E_BUSY if the CPU can't promise e that much time.
+//
+int
+sched_setattr(struct Env *e, uint32_t runtime, uint32_t period,
+	      uint32_t deadline)
+{
+	struct Env **pp;
+	uint32_t bw, old_bw;
+	bool queued;
+
+	if (period && (runtime == 0 || runtime > deadline
+		       || deadline > period
+		       || period > (uint32_t) -1 / SCHED_DL_BW_ONE))
+		return -E_INVAL;
+	if (!period)
+		runtime = deadline = 0;
+	bw = sched_dl_bw(runtime, period);
+	old_bw = sched_dl_bw(e->env_dl_runtime, e->env_dl_period);
+	if (dl_bw - old_bw + bw > SCHED_DL_BW_MAX)
+		return -E_BUSY;
+	dl_bw = dl_bw - old_bw + bw;
+
+	// Move e between the run queues and dl_list.
+	queued = e->env_status == ENV_RUNNABLE;
+	if (queued)
+		sched_dequeue(e);
+	if (e->env_dl_period && !period) {
+		for (pp = &dl_list; *pp != e; pp = &(*pp)->env_dl_next)
+			/* do nothing */;
+		*pp = e->env_dl_next;
+	} else if (!e->env_dl_period && period) {
+		e->env_dl_next = dl_list;
+		dl_list = e;
+		e->env_cpu = bootcpu - cpus;
+	}
+
+	e->env_dl_runtime = runtime;
+	e->env_dl_period = period;
+	e->env_dl_deadline = deadline;
+	e->env_dl_budget = runtime;
+	e->env_dl_due = ticks + deadline;
+	e->env_dl_release = ticks + period;
+	e->env_dl_jobs = period ? 1 : 0;
+	e->env_dl_misses = 0;
+	if (queued)
+		sched_enqueue(e);
+	return 0;
+}
+
+// Returns the deadline environment that should run next: of those that
+// are runnable, or running here, and have budget left, the one whose job
+// is due first.  Returns NULL if there is none, or if this is not the
+// boot CPU.
+static struct Env *
+sched_dl_pick(void)
+{
+	struct Env *e, *best = NULL;
+
+	if (thiscpu != bootcpu)
+		return NULL;
+	for (e = dl_list; e; e = e->env_dl_next) {
+		if (e->env_dl_budget == 0)
+			continue;
+		if (e->env_status != ENV_RUNNABLE
+		    && !(e == curenv && e->env_status == ENV_RUNNING))
+			continue;
+		if (!best || (int32_t) (e->env_dl_due - best->env_dl_due) < 0)
+			best = e;
+	}
+	return best;
+}
+
+// Charge a tick to the deadline job running on this CPU.  On the boot
+// CPU, whose ticks are the ones counted, also count missed deadlines and
+// release new jobs.
+static void
+sched_dl_tick(void)
+{
+	struct Env *e;
+
+	if (curenv && curenv->env_dl_budget
+	    && curenv->env_status == ENV_RUNNING)
+		curenv->env_dl_budget--;
+	if (thiscpu != bootcpu)
+		return;
+
+	for (e = dl_list; e; e = e->env_dl_next) {
+		if (e->env_dl_budget && (int32_t) (ticks - e->env_dl_due) >= 0) {
+			e->env_dl_misses++;
+			e->env_dl_budget = 0;
+		}
+		if ((int32_t) (ticks - e->env_dl_release) >= 0) {
+			e->env_dl_budget = e->env_dl_runtime;
+			e->env_dl_due = ticks + e->env_dl_deadline;
+			e->env_dl_release = ticks + e->env_dl_period;
+			e->env_dl_jobs++;
+		}
+	}
+}
+
+// Returns true if an environment is waiting to run on this CPU at level
+// 'level' or above.
+static bool
+sched_waiting(int level)
+{
+	struct RunQueue *rq = &runqs[cpunum()];
+	int i;
+
+	for (i = 0; i <= level; i++)
+		if (rq->level[i].head)
+			return 1;
+	return 0;
+}
+
+// Move every environment back to the level of its priority.  Those
+// running on other CPUs catch up when they are next enqueued.
+static void
+sched_boost(void)
+{
+	struct Env *e, *next;
+	int i, level;
+
+	boost_epoch++;
+	for (i = 0; i < ncpu; i++)
+		for (level = 1; level < SCHED_NLEVELS; level++)
+			for (e = runqs[i].level[level].head; e; e = next) {
+				next = e->env_rq_next;
+				if (e->env_priority < level) {
+					// sched_enqueue moves it up
+					sched_dequeue(e);
+					sched_enqueue(e);
+				}
+			}
+	if (curenv) {
+		sched_set_level(curenv, curenv->env_priority);
+		curenv->env_epoch = boost_epoch;
+	}
+}
+
+//
+// Count a timer interrupt against the current environment's time slice.
+// Returns true if it should be preempted: a deadline job other than its
+// own should run, or it is a deadline environment with no job to run, or
+// its slice is out and another environment is waiting at its new level
+// or above, or one is waiting at a level above it.
+//
+bool
+sched_tick(void)
+{
+	struct Env *e = curenv, *dl;
+
+	// Every CPU's timer interrupts at HZ, so only the boot CPU's ticks
+	// count towards the time.
+	if (thiscpu == bootcpu && ++ticks % SCHED_BOOST_TICKS == 0)
+		sched_boost();
+	sched_dl_tick();
+	if (!e || e->env_status != ENV_RUNNING)
+		return 1;
+	if ((dl = sched_dl_pick()))
+		return dl != e;
+	if (e->env_dl_period)
+		return 1;
+
+	if (--e->env_slice <= 0) {
+		sched_set_level(e, MIN(e->env_level + 1, SCHED_NLEVELS - 1));
+		return sched_waiting(e->env_level);
+	}
+	return sched_waiting(e->env_level - 1);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct RunQueue *rq = &runqs[cpunum()];
+	struct Env *e;
+	int i, level;
+
+	// Deadline jobs go first.
+	if ((e = sched_dl_pick()))
+		env_run(e);
+
+	// A deadline environment still running here has no job to run, or
+	// is on another CPU than the boot CPU: it goes back to waiting for
+	// its next job, on the boot CPU.
+	if (curenv && curenv->env_dl_period
+	    && curenv->env_status == ENV_RUNNING) {
+		curenv->env_runtime += read_tsc() - curenv->env_stamp;
+		curenv->env_status = ENV_RUNNABLE;
+		sched_enqueue(curenv);
+		curenv = NULL;
+	}
+
+	// Run the environment at the head of this CPU's highest run queue
+	// that has one; env_run puts the current one, if it is still
+	// running, at the tail of its own.  If no other environment is
+	// runnable here, keep running the current one.
+	for (level = 0; level < SCHED_NLEVELS; level++)
+		if (rq->level[level].head)
+			env_run(rq->level[level].head);
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
+
+	// Otherwise take one that is waiting for another CPU.
+	for (level = 0; level < SCHED_NLEVELS; level++)
+		for (i = 0; i < ncpu; i++)
+			if ((e = runqs[i].level[level].head)) {
+				rq->steals++;
+				env_run(e);
+			}
+
+	// sched_halt never returns
+	sched_halt();
+}
+
+// Halt this CPU when there is nothing to do.  Wait until the timer
+// interrupt wakes it up.  This function never returns.
+static void
+sched_halt(void)
+{
+	// For debugging and testing purposes, if there are no
+	// environments left in the system, then drop into the kernel
+	// monitor.
+	if (env_nlive == 0) {
+		cprintf("Destroyed the only environment - nothing more to do!\n");
+		while (1)
+			monitor(NULL);
+	}
+
+	// Mark that no environment is running on this CPU
+	if (curenv)
+		curenv->env_runtime += read_tsc() - curenv->env_stamp;
+	curenv = NULL;
+	lcr3(PADDR(kern_pgdir));
+
+	// Use a little of the idle time for background work.  Each call
+	// does a bounded amount, so the next interrupt is not held up.
+	page_zero_idle();
+	ksm_scan();
+
+	// Mark that this CPU is in the HALT state, so that when
+	// timer interupts come in, we know we should re-acquire the
+	// big kernel lock
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+
+	// Release the big kernel lock as if we were "leaving" the kernel
+	unlock_kernel();
+
+	// Reset stack pointer, enable interrupts and then halt.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: hlt returned");
+}
+
+//
+// Print each environment's scheduling state and the time it has spent
+// running and waiting to run, in thousands of TSC cycles, then the
+// parameters and deadline misses of the deadline environments, in ticks.
+//
+void
+sched_print_stats(void)
+{
+	static const char * const status[] = {
+		"free", "dying", "runnable", "running", "blocked"
+	};
+	struct Env *e;
+	int i;
+
+	cprintf("Ticks: %u\n", ticks);
+	cprintf("  cpu queued   steals\n");
+	for (i = 0; i < ncpu; i++)
+		cprintf("  %3d %6d %8u\n", i, runqs[i].nqueued, runqs[i].steals);
+	cprintf("  envid    status   cpu pri lvl slice     runs    run(Kcyc)   wait(Kcyc)\n");
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("  %08x %-8s %3d %3d %3d %5d %8u %12llu %12llu\n",
+			e->env_id, status[e->env_status], e->env_cpu,
+			e->env_priority, e->env_level, e->env_slice,
+			e->env_runs, e->env_runtime / 1000,
+			e->env_waittime / 1000);
+	}
+
+	if (!dl_list)
+		return;
+	cprintf("Deadline environments, %u/%u of CPU %d promised:\n",
+		dl_bw, SCHED_DL_BW_ONE, bootcpu->cpu_id);
+	cprintf("  envid    runtime period deadline budget     jobs   misses\n");
+	for (e = dl_list; e; e = e->env_dl_next)
+		cprintf("  %08x %7u %6u %8u %6u %8u %8u\n", e->env_id,
+			e->env_dl_runtime, e->env_dl_period, e->env_dl_deadline,
+			e->env_dl_budget, e->env_dl_jobs, e->env_dl_misses);
+}
@@ -0,0 +1,46 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SCHED_H
+#define JOS_KERN_SCHED_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Multi-level feedback queue: an environment runs at one of SCHED_NLEVELS
+// levels, and level 0 runs first.  A new environment starts at the level
+// of its priority.  Using up the time slice of its level moves it down a
+// level, where slices are twice as long; giving up the CPU early moves it
+// back up, but never above its priority.  Every SCHED_BOOST_TICKS, all
+// environments go back to the level of their priority, so that nothing
+// runnable starves.
+#define SCHED_NLEVELS		ENV_NPRIORITY
+#define SCHED_QUANTUM(level)	(1 << (level))	// Timer ticks per slice
+#define SCHED_BOOST_TICKS	100		// One second at HZ
+
+// Deadline scheduling: an environment may instead ask for 'runtime' ticks
+// of CPU in each job, released every 'period' ticks and due 'deadline'
+// ticks after its release.  Environments with jobs to run go ahead of all
+// others, earliest deadline first.  They all run on the boot CPU, whose
+// ticks release their jobs, so sched_setattr admits one only if the share
+// of that CPU already promised, plus runtime/period, stays within
+// SCHED_DL_BW_MAX.
+#define SCHED_DL_BW_ONE		1024		// The whole CPU
+#define SCHED_DL_BW_MAX		972		// 95% of it
+
+extern volatile uint32_t ticks;		// Timer interrupts since boot
+
+// This function does not return.
+void	sched_yield(void) __attribute__((noreturn));
+bool	sched_tick(void);
+void	sched_enqueue(struct Env *e);
+void	sched_dequeue(struct Env *e);
+void	sched_relinquish(struct Env *e);
+void	sched_set_priority(struct Env *e, int priority);
+int	sched_setattr(struct Env *e, uint32_t runtime, uint32_t period,
+		      uint32_t deadline);
+void	sched_print_stats(void);
+
+#endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,99 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
+
+// The big kernel lock
+struct spinlock kernel_lock = { 0, "kernel_lock", -1 };
+
+void
+__spin_initlock(struct spinlock *lk, const char *name)
+{
+	lk->locked = 0;
+	lk->name = name;
+	lk->cpu = -1;
+}
+
+// Check whether this CPU is holding the lock.
+bool
+spin_holding(struct spinlock *lk)
+{
+	return lk->locked && lk->cpu == cpunum();
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct spinlock *lk)
+{
+	if (spin_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+
+	// The xchg is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	while (xchg(&lk->locked, 1) != 0)
+		asm volatile ("pause");
+
+	lk->cpu = cpunum();
+}
+
+// Try to acquire the lock, without spinning.  Returns true on success.
+bool
+spin_trylock(struct spinlock *lk)
+{
+	if (spin_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	if (xchg(&lk->locked, 1) != 0)
+		return 0;
+	lk->cpu = cpunum();
+	return 1;
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+	if (!spin_holding(lk))
+		panic("CPU %d cannot release %s: not holding", cpunum(), lk->name);
+
+	lk->cpu = -1;
+
+	// The xchg serializes, so that reads before release are
+	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
+	// 7.2) says reads can be carried out speculatively and in
+	// any order, which implies we need to serialize here.
+	xchg(&lk->locked, 0);
+}
+
+// Acquire the big kernel lock.  The CPU holding it may be waiting for
+// this one to flush its TLB (see tlb_shootdown), or to run its cpu_call
+// function, and interrupts are off here, so do that while spinning.
+// cpu_call is cleared once the function returns.
+void
+lock_kernel(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	while (!spin_trylock(&kernel_lock)) {
+		tlb_shootdown_recv();
+		if (c->cpu_call) {
+			c->cpu_call();
+			c->cpu_call = NULL;
+		}
+		asm volatile ("pause");
+	}
+}
+
+void
+unlock_kernel(void)
+{
+	spin_unlock(&kernel_lock);
+}
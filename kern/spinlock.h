@@ -0,0 +1,34 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Mutual exclusion lock.
+struct spinlock {
+	volatile uint32_t locked;	// Is the lock held?
+
+	// For debugging:
+	const char *name;		// Name of lock.
+	int cpu;			// The CPU holding the lock, or -1.
+};
+
+void	__spin_initlock(struct spinlock *lk, const char *name);
+void	spin_lock(struct spinlock *lk);
+bool	spin_trylock(struct spinlock *lk);
+void	spin_unlock(struct spinlock *lk);
+bool	spin_holding(struct spinlock *lk);
+
+#define spin_initlock(lock)	__spin_initlock(lock, #lock)
+
+// The big kernel lock.  Each CPU holds it from the time it enters the
+// kernel from user mode, or leaves sched_halt, until it returns to user
+// mode or halts, so only one CPU runs kernel code at a time.
+extern struct spinlock kernel_lock;
+
+void	lock_kernel(void);
+void	unlock_kernel(void);
+
+#endif	// !JOS_KERN_SPINLOCK_H
@@ -0,0 +1,301 @@
+/* See COPYRIGHT for copyright information. */
+
+// Swapping user pages out to disk (see kern/swap.h).
+//
+// Slot n of the swap disk holds a page at sectors [n*SWAP_SECTS,
+// (n+1)*SWAP_SECTS).  swap_map counts the swap entries that refer to
+// each slot; a slot is free when its count is zero.
+//
+// Victims are chosen with the clock algorithm: a hand sweeps round the
+// pages array, and a page that has been used since the hand last passed
+// (PTE_A set in any PTE in its reverse map) has its accessed bits
+// cleared and is passed over.  Only pages page_compact could migrate
+// are candidates, so page tables, 4MB pages and kernel memory stay put.
+//
+// A page mapped by several PTEs comes back as a separate copy for each
+// of them, as they fault it in one at a time.  That is only right if
+// none of them can write the page, as is the case for the copy-on-write
+// sharing that sys_fork sets up; a page shared writably stays resident.
+//
+// Like the reverse maps it relies on, swapping is not locked; callers
+// must serialize changes to the page tables.
+
+#include <inc/types.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/swap.h>
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/rmap.h>
+#include <kern/env.h>
+
+#define SWAP_SECTS	(PGSIZE / SECTSIZE)	// Disk sectors per slot
+
+static uint16_t swap_map[SWAP_SLOTS_MAX];	// Swap entries per slot
+static uint32_t swap_nslots;		// Slots on the disk; 0 if no swap
+static uint32_t swap_nused;		// Slots in use
+static uint32_t swap_next;		// Where to look for a free slot
+static size_t swap_hand;		// The clock hand, a page number
+
+static struct {
+	uint32_t outs;		// Pages written out
+	uint32_t ins;		// Pages read back in
+	uint32_t scanned;	// Pages the clock hand has passed
+	uint32_t referenced;	// ... that were passed over as recently used
+	uint32_t full;		// Times reclaim stopped with no free slot
+} swap_stats;
+
+//
+// Look for swap space on the second IDE disk.  Without it, swap_reclaim
+// does nothing and running out of memory fails allocations as before.
+//
+void
+swap_init(void)
+{
+	uint32_t nsecs;
+
+	if (!(nsecs = ide_disk_size(SWAP_DISK))) {
+		cprintf("swap: no disk %d, swapping disabled\n", SWAP_DISK);
+		return;
+	}
+	swap_nslots = MIN(nsecs / SWAP_SECTS, SWAP_SLOTS_MAX);
+	cprintf("swap: %u KB on disk %d\n", swap_nslots * (PGSIZE / 1024),
+		SWAP_DISK);
+}
+
+// Returns a free slot, or -E_NO_MEM if swap space is full.  The slot is
+// not taken until its count is set.
+static int
+swap_slot_find(void)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < swap_nslots; i++) {
+		slot = (swap_next + i) % swap_nslots;
+		if (swap_map[slot] == 0) {
+			swap_next = slot + 1;
+			return slot;
+		}
+	}
+	return -E_NO_MEM;
+}
+
+// Take another reference on the slot held by swap entry 'pte', which is
+// being copied into another page table.
+void
+swap_dup(pte_t pte)
+{
+	assert(PTE_IS_SWAP(pte) && swap_map[PTE_SWAP_SLOT(pte)] > 0);
+	swap_map[PTE_SWAP_SLOT(pte)]++;
+}
+
+// Drop the reference that swap entry 'pte' holds on its slot, which is
+// freed once no swap entry refers to it.
+void
+swap_free(pte_t pte)
+{
+	assert(PTE_IS_SWAP(pte) && swap_map[PTE_SWAP_SLOT(pte)] > 0);
+	if (--swap_map[PTE_SWAP_SLOT(pte)] == 0)
+		swap_nused--;
+}
+
+struct swap_scan {
+	bool referenced;	// Some PTE had PTE_A set
+	int writable;		// PTEs with PTE_W set
+};
+
+static int
+swap_scan_pte(pte_t *ptep, void *arg)
+{
+	struct swap_scan *scan = arg;
+
+	if (*ptep & PTE_A) {
+		scan->referenced = 1;
+		*ptep &= ~PTE_A;
+	}
+	scan->writable += (*ptep & PTE_W) != 0;
+	return 0;
+}
+
+static int
+swap_unmap_pte(pte_t *ptep, void *arg)
+{
+	*ptep = PTE_SWAP_MAKE(*(int *) arg, *ptep);
+	return 0;
+}
+
+static int
+swap_remap_pte(pte_t *ptep, void *arg)
+{
+	*ptep = page2pa(arg) | (*ptep & PTE_SYSCALL) | PTE_P;
+	return 0;
+}
+
+// Turn every PTE that maps page 'pp' into a swap entry for a free slot,
+// which is returned, or -E_NO_MEM if swap space is full.  The page
+// itself is untouched until swap_out writes it, once the caller has
+// flushed the TLB entries that would still let a CPU write to it.
+static int
+swap_unmap(struct PageInfo *pp)
+{
+	int slot;
+
+	if ((slot = swap_slot_find()) < 0)
+		return slot;
+
+	// Every reference is a mapping, so each becomes a swap entry.
+	swap_map[slot] = pp->pp_ref;
+	swap_nused++;
+	rmap_walk(pp, swap_unmap_pte, &slot);
+	return slot;
+}
+
+// Write page 'pp', unmapped by swap_unmap, to 'slot' and free it.  If
+// the write fails, map it again instead.  Returns 0 on success, < 0 if
+// the write failed.
+static int
+swap_out(struct PageInfo *pp, int slot)
+{
+	void *kva;
+	int r;
+
+	kva = kmap(pp);
+	r = ide_write(SWAP_DISK, slot * SWAP_SECTS, kva, SWAP_SECTS);
+	kunmap(kva);
+	if (r < 0) {
+		rmap_walk(pp, swap_remap_pte, pp);
+		swap_map[slot] = 0;
+		swap_nused--;
+		return r;
+	}
+
+	rmap_clear(pp);
+	pp->pp_ref = 0;
+	page_free(pp);
+	swap_stats.outs++;
+	return 0;
+}
+
+//
+// Free up to 'n' pages, at most SWAP_CLUSTER at a time, by writing cold
+// user pages out to swap.  The clock hand goes round at most twice, so
+// that pages passed over the first time for being recently used can
+// still be taken.
+//
+// The victims are all unmapped, and the TLBs of every CPU flushed,
+// before any of them is written out, so that no CPU can still be
+// writing to a page while it is on its way to disk.
+//
+// Returns the number of pages freed.
+//
+int
+swap_reclaim(int n)
+{
+	struct PageInfo *victims[SWAP_CLUSTER];
+	int slots[SWAP_CLUSTER];
+	struct swap_scan scan;
+	struct PageInfo *pp;
+	size_t scanned;
+	int i, nvictims = 0, freed = 0;
+	bool cleared = 0;
+
+	if (swap_nslots == 0)
+		return 0;
+
+	n = MIN(n, SWAP_CLUSTER);
+	for (scanned = 0; nvictims < n && scanned < 2 * npages; scanned++) {
+		pp = &pages[swap_hand];
+		swap_hand = (swap_hand + 1) % npages;
+		if (!page_movable(pp))
+			continue;
+
+		scan.referenced = 0;
+		scan.writable = 0;
+		rmap_walk(pp, swap_scan_pte, &scan);
+		if (scan.referenced) {
+			swap_stats.referenced++;
+			cleared = 1;
+			continue;
+		}
+		if (pp->pp_ref > 1 && scan.writable)
+			continue;
+		if ((slots[nvictims] = swap_unmap(pp)) < 0) {
+			swap_stats.full++;
+			break;
+		}
+		victims[nvictims++] = pp;
+	}
+	swap_stats.scanned += scanned;
+
+	// Drop the TLB entries of the pages unmapped, and those that would
+	// keep the CPUs from setting the accessed bits just cleared.
+	if (nvictims || cleared)
+		tlb_flush_all();
+
+	for (i = 0; i < nvictims; i++)
+		if (swap_out(victims[i], slots[i]) == 0)
+			freed++;
+	return freed;
+}
+
+//
+// If 'va' in environment e holds a swap entry, read its page back in and
+// map it there again.
+//
+// Returns 0 if a page was swapped in, -E_FAULT if 'va' is not swapped
+// out, -E_NO_MEM if out of memory, -E_IO on a disk error.
+//
+int
+swap_in(struct Env *e, uintptr_t va)
+{
+	struct PageInfo *pp;
+	pte_t *pte, entry;
+	void *kva;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(pte = pgdir_walk(e->env_pgdir, (void *) va, 0))
+	    || !PTE_IS_SWAP(*pte))
+		return -E_FAULT;
+
+	// Allocating may swap other pages out, but leaves this entry be.
+	if (!(pp = page_alloc(ALLOC_HIGHMEM)))
+		return -E_NO_MEM;
+	entry = *pte;
+	kva = kmap(pp);
+	r = ide_read(SWAP_DISK, PTE_SWAP_SLOT(entry) * SWAP_SECTS, kva,
+		     SWAP_SECTS);
+	kunmap(kva);
+
+	// page_insert frees the swap entry it replaces.  The page starts
+	// out accessed, so the clock hand doesn't take it straight back
+	// before it has been used.
+	if (r < 0 || (r = page_insert(e->env_pgdir, pp, (void *) va,
+				      (entry & PTE_SYSCALL & ~PTE_P) | PTE_A)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	swap_stats.ins++;
+	return 0;
+}
+
+//
+// Print swap space usage and paging statistics.
+//
+void
+swap_print_stats(void)
+{
+	if (swap_nslots == 0) {
+		cprintf("Swapping disabled\n");
+		return;
+	}
+	cprintf("Swap space: %u of %u KB used\n",
+		swap_nused * (PGSIZE / 1024), swap_nslots * (PGSIZE / 1024));
+	cprintf("Pages out: %u in: %u\n", swap_stats.outs, swap_stats.ins);
+	cprintf("Clock: %u pages scanned, %u referenced, %u times out of slots\n",
+		swap_stats.scanned, swap_stats.referenced, swap_stats.full);
+}
@@ -0,0 +1,34 @@
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+struct Env;
+
+// Swap space: when physical memory runs out, page_alloc asks swap_reclaim
+// to write cold user pages to the second IDE disk.  Each PTE that mapped
+// an evicted page is replaced by a swap entry: PTE_P clear, PTE_SWAP set,
+// the page's slot on disk in the address bits, and the mapping's
+// permissions in the low bits.  A fault on a swap entry reads the page
+// back in with swap_in.  Swap entries hold references on their slot, as
+// PTEs do on pages.
+
+#define SWAP_DISK	1		// IDE disk holding swap space
+#define SWAP_SLOTS_MAX	8192		// 32MB of swap space at most
+#define SWAP_CLUSTER	32		// Pages swap_reclaim aims to free
+
+#define PTE_IS_SWAP(pte)	(((pte) & (PTE_P | PTE_SWAP)) == PTE_SWAP)
+#define PTE_SWAP_SLOT(pte)	((pte) >> PGSHIFT)
+#define PTE_SWAP_MAKE(slot, perm) \
+	(((pte_t) (slot) << PGSHIFT) | PTE_SWAP | ((perm) & PTE_SYSCALL & ~PTE_P))
+
+void	swap_init(void);
+int	swap_reclaim(int n);
+int	swap_in(struct Env *e, uintptr_t va);
+void	swap_dup(pte_t pte);
+void	swap_free(pte_t pte);
+void	swap_print_stats(void);
+
+#endif	// !JOS_KERN_SWAP_H
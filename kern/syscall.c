@@ -10,6 +10,8 @@
 #include <kern/trap.h>
 #include <kern/syscall.h>
 #include <kern/console.h>
+#include <kern/sched.h>
+#include <kern/kclock.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -21,10 +23,24 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
+    // Check the whole range before printing any of it, so that a bad
+    // buffer produces no output.
     user_mem_assert(curenv, s, len, PTE_U);
 
 	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+    char buf[128];
+    size_t n;
+    for (; len > 0; s += n, len -= n) {
+        n = MIN(len, sizeof(buf));
+        if (copy_from_user(curenv, buf, s, n) < 0) {
+            // Swapping a page back in, or filling in a demand-zero
+            // page, can still fail when memory runs out.
+            cprintf("[%08x] sys_cputs: buffer became inaccessible\n",
+                    curenv->env_id);
+            env_destroy(curenv);    // does not return
+        }
+        cprintf("%.*s", n, buf);
+    }
 }
 
 // Read a character from the system console without blocking.
@@ -42,6 +58,16 @@ sys_getenvid(void)
 	return curenv->env_id;
 }
 
+// Deschedule current environment and pick a different one to run.
+// Giving up the CPU early moves the environment up a scheduling level,
+// or ends the current job of a deadline environment.
+static void
+sys_yield(void)
+{
+	sched_relinquish(curenv);
+	sched_yield();
+}
+
 // Destroy a given environment (possibly the currently running environment).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
@@ -63,6 +89,142 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
+// Create a new environment that is a copy of the caller: the same
+// registers, except that the child sees 0 returned from sys_fork, and a
+// copy-on-write copy of the address space below UTOP.  The child starts
+// out ENV_RUNNABLE.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	if ((r = env_cow_clone(e, curenv)) < 0) {
+		env_free(e);
+		return r;
+	}
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	sched_set_priority(e, curenv->env_priority);
+	return e->env_id;
+}
+
+// Set the scheduling priority of environment envid, from 0, which runs
+// first, to ENV_NPRIORITY - 1.  The environment starts over at the level
+// of its new priority (see kern/sched.h).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is out of range.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (priority < 0 || priority >= ENV_NPRIORITY)
+		return -E_INVAL;
+	sched_set_priority(e, priority);
+	return 0;
+}
+
+// Allocate a page of memory and map it at 'va' with permission
+// 'perm' in the address space of 'envid'.
+// The page's contents are set to 0.  A 4KB page starts out as the
+// shared zero page, and gets memory of its own when first written.
+// If a page is already mapped at 'va', that page is unmapped as a
+// side effect.
+//
+// If perm has PTE_PS set, a 4MB page is allocated instead and mapped
+// with a single page directory entry; 'va' must be 4MB-aligned, and
+// anything mapped in [va, va+PTSIZE) is unmapped.
+//
+// perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W | PTE_PS may or
+//         may not be set, but no other bits may be set.  See PTE_SYSCALL
+//         in inc/mmu.h.  PTE_COW is reserved for the kernel.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if PTE_PS is set and the CPU doesn't support 4MB pages.
+//	-E_NO_MEM if there's no memory to allocate the new page,
+//		or to allocate any necessary page tables.
+static int
+sys_page_alloc(envid_t envid, void *va, int perm)
+{
+	struct PageInfo *pp;
+	struct Env *e;
+	size_t align = (perm & PTE_PS) ? PTSIZE : PGSIZE;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % align)
+		return -E_INVAL;
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)
+	    || (perm & ~(PTE_SYSCALL | PTE_PS)) || (perm & PTE_COW))
+		return -E_INVAL;
+
+	if (!(perm & PTE_PS)) {
+		if (page_insert_zero(e->env_pgdir, va, perm) == 0)
+			return 0;
+		if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)))
+			return -E_NO_MEM;
+		if ((r = page_insert(e->env_pgdir, pp, va, perm)) < 0)
+			page_free(pp);
+		return r;
+	}
+
+	if (!(pp = page_alloc_order(MAX_ORDER, ALLOC_ZERO | ALLOC_HIGHMEM)))
+		return -E_NO_MEM;
+	if ((r = page_insert_large(e->env_pgdir, pp, va, perm & ~PTE_PS)) < 0)
+		page_free_order(pp, MAX_ORDER);
+	return r;
+}
+
+// Make environment envid a deadline environment, which runs ahead of all
+// best-effort ones: every 'period' milliseconds it is released a job of
+// 'runtime' milliseconds of CPU time, due 'deadline' milliseconds after
+// its release.  A deadline of 0 means the job is due at the end of the
+// period; a period of 0 makes envid best-effort again.  Times are
+// rounded down to whole timer ticks.  A deadline environment ends its
+// job early by calling sys_yield.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL unless 0 < runtime <= deadline <= period, in ticks.
+//	-E_BUSY if admitting envid would promise more CPU time to deadline
+//		environments than the kernel allows.  They all share the
+//		boot CPU.
+static int
+sys_sched_setattr(envid_t envid, uint32_t runtime, uint32_t period,
+		  uint32_t deadline)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (deadline == 0)
+		deadline = period;
+	if (period > (uint32_t) -1 / HZ || runtime > period || deadline > period)
+		return -E_INVAL;
+	return sched_setattr(e, runtime * HZ / 1000, period * HZ / 1000,
+			     deadline * HZ / 1000);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -88,6 +250,27 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             // sys_env_destroy(envid_t envid)
             return sys_env_destroy(a1);
             break;
+        case SYS_fork:
+            // envid_t sys_fork(void)
+            return sys_fork();
+            break;
+        case SYS_page_alloc:
+            // int sys_page_alloc(envid_t envid, void *va, int perm)
+            return sys_page_alloc(a1, (void*) a2, a3);
+            break;
+        case SYS_yield:
+            // void sys_yield(void)
+            sys_yield();
+            break;
+        case SYS_env_set_priority:
+            // int sys_env_set_priority(envid_t envid, int priority)
+            return sys_env_set_priority(a1, a2);
+            break;
+        case SYS_sched_setattr:
+            // int sys_sched_setattr(envid_t envid, uint32_t runtime,
+            //                       uint32_t period, uint32_t deadline)
+            return sys_sched_setattr(a1, a2, a3, a4);
+            break;
 	}
 
     return -E_NO_SYS;
@@ -8,8 +8,10 @@
 #include <kern/monitor.h>
 #include <kern/env.h>
 #include <kern/syscall.h>
-
-static struct Taskstate ts;
+#include <kern/swap.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -55,6 +57,10 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
+		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_TLB)
+		return "TLB Shootdown";
 	return "(unknown trap)";
 }
 
@@ -69,13 +75,15 @@ trap_init(void)
 
     // Setup mappings from the lowest to highest known trap number.
     // Most traps have DPL 0, so traps with other DPLs go below loop.
+    // All are interrupt gates, so that the kernel always runs with
+    // interrupts disabled.
     int i;
-    for (i = T_DIVIDE; i <= T_SYSCALL; i++) {
-        SETGATE(idt[i], 1, GD_KT, trap_handlers[i], 0);
+    for (i = T_DIVIDE; i <= IRQ_OFFSET + IRQ_TLB; i++) {
+        SETGATE(idt[i], 0, GD_KT, trap_handlers[i], 0);
     }
 
-    SETGATE(idt[T_BRKPT], 1, GD_KT, trap_handlers[T_BRKPT], 3);
-    SETGATE(idt[T_SYSCALL], 1, GD_KT, trap_handlers[T_SYSCALL], 3);
+    SETGATE(idt[T_BRKPT], 0, GD_KT, trap_handlers[T_BRKPT], 3);
+    SETGATE(idt[T_SYSCALL], 0, GD_KT, trap_handlers[T_SYSCALL], 3);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -85,19 +93,22 @@ trap_init(void)
 void
 trap_init_percpu(void)
 {
-	// Setup a TSS so that we get the right stack
-	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	int i = cpunum();
+
+	// Setup a TSS so that we get the right stack when we trap to the
+	// kernel: this CPU's own, mapped by mem_init.
+	ts->ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	ts->ts_ss0 = GD_KD;
 
-	// Initialize the TSS slot of the gdt.
-	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	// Initialize this CPU's TSS slot of the gdt.
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate) - 1, 0);
-	gdt[GD_TSS0 >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	lidt(&idt_pd);
@@ -179,6 +190,20 @@ trap_dispatch(struct Trapframe *tf)
                 tf->tf_regs.reg_edi,
                 tf->tf_regs.reg_esi);
             return;
+        case IRQ_OFFSET + IRQ_TIMER:
+            // Preempt the running environment if its time slice is
+            // out, or a higher-priority one is waiting.
+            lapic_eoi();
+            if (sched_tick())
+                sched_yield();
+            return;
+        case IRQ_OFFSET + IRQ_SPURIOUS:
+            // Handle spurious interrupts
+            // The hardware sometimes raises these because of noise on the
+            // IRQ line or other reasons. We don't care.
+            cprintf("Spurious interrupt on irq 7\n");
+            print_trapframe(tf);
+            return;
     }
 
 	// Unexpected trap: The user process or the kernel has a bug.
@@ -203,12 +228,38 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
-	cprintf("Incoming TRAP frame at %p\n", tf);
+	// The CPU that asked for a TLB shootdown holds the kernel lock
+	// while it waits, so flush without taking it (see tlb_shootdown).
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		tlb_shootdown_recv();
+		lapic_eoi();
+		env_pop_tf(tf);
+	}
+
+	// Halt if some other CPU has called panic()
+	if (panicstr)
+		asm volatile("hlt");
+
+	// Acquire the big kernel lock if we were halted in sched_halt, or
+	// trapped from user mode.
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED
+	    || (tf->tf_cs & 3) == 3)
+		lock_kernel();
+
+	if (tf->tf_trapno < IRQ_OFFSET || tf->tf_trapno >= IRQ_OFFSET + 16)
+		cprintf("Incoming TRAP frame at %p\n", tf);
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
 		assert(curenv);
 
+		// Garbage collect if current environment is a zombie
+		if (curenv->env_status == ENV_DYING) {
+			env_free(curenv);
+			curenv = NULL;
+			sched_yield();
+		}
+
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
 		// will restart at the trap point.
@@ -224,9 +275,13 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
-	// Return to the current environment, which should be running.
-	assert(curenv && curenv->env_status == ENV_RUNNING);
-	env_run(curenv);
+	// If we made it to this point, then no other environment was
+	// scheduled, so we should return to the current environment
+	// if doing so makes sense.
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
+	else
+		sched_yield();
 }
 
 
@@ -245,6 +300,19 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// A not-present fault on a swapped-out page reads it back in; one
+	// in a demand-zero region just needs its page.
+	if (!(tf->tf_err & FEC_PR)
+	    && (swap_in(curenv, fault_va) == 0
+		|| env_demand_page(curenv, fault_va,
+				   tf->tf_err & FEC_WR) == 0))
+		return;
+
+	// A write to a copy-on-write page needs a private copy.
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)
+	    && env_cow_fault(curenv, fault_va) == 0)
+		return;
+
 	// Destroy the environment that caused the fault.
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
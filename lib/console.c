@@ -16,9 +16,11 @@ int
 getchar(void)
 {
 	int r;
-	// sys_cgetc does not block, but getchar should.
+	// sys_cgetc does not block, but getchar should.  Give up the CPU
+	// while waiting, which also marks this environment as interactive
+	// to the scheduler.
 	while ((r = sys_cgetc()) == 0)
-		;
+		sys_yield();
 	return r;
 }
 
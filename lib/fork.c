@@ -0,0 +1,20 @@
+// implement fork on top of the kernel's copy-on-write sys_fork
+
+#include <inc/lib.h>
+
+//
+// Create a child process that is a copy of this one.  The kernel shares
+// the address space copy-on-write, so fork itself only has to fix up
+// 'thisenv' in the child.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	if ((envid = sys_fork()) == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
+}
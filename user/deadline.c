@@ -0,0 +1,73 @@
+// Run two deadline environments alongside a best-effort CPU hog, check
+// that their jobs run in deadline order and none is missed, and that
+// admission control refuses more CPU time than there is.
+
+#include <inc/lib.h>
+
+#define JOBS	10
+
+void
+umain(int argc, char **argv)
+{
+	const volatile struct Env *c;
+	envid_t hog, child;
+	uint32_t job;
+	int i, r;
+
+	if ((hog = fork()) < 0)
+		panic("fork: %e", hog);
+	if (hog == 0) {
+		// Best-effort: spin until the parent is done.
+		while (1)
+			/* do nothing */;
+	}
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		// Each job ends at once; the parent sets the deadlines.
+		while (1)
+			sys_yield();
+	}
+	c = &envs[ENVX(child)];
+
+	// The whole CPU can't be promised, nor can more than a job's
+	// period per job.
+	if ((r = sys_sched_setattr(0, 100, 100, 0)) != -E_BUSY)
+		panic("sys_sched_setattr 100%%: got %e, expected busy", r);
+	if ((r = sys_sched_setattr(0, 50, 20, 0)) != -E_INVAL)
+		panic("sys_sched_setattr runtime > period: got %e", r);
+
+	// 20ms of every 100ms, due 80ms after release, for this env, and
+	// 10ms due 30ms after release for the child.  Both must release
+	// their jobs on the same tick, so that the child's are always due
+	// first.
+	do {
+		if ((r = sys_sched_setattr(0, 20, 100, 80)) < 0)
+			panic("sys_sched_setattr: %e", r);
+		if ((r = sys_sched_setattr(child, 10, 100, 30)) < 0)
+			panic("sys_sched_setattr child: %e", r);
+	} while (c->env_dl_release != thisenv->env_dl_release);
+	if ((r = sys_sched_setattr(child, 90, 100, 0)) != -E_BUSY)
+		panic("sys_sched_setattr over the limit: got %e, expected busy",
+		      r);
+
+	for (i = 0; i < JOBS; i++) {
+		// End this job; the next starts with the next release.
+		job = thisenv->env_dl_jobs;
+		sys_yield();
+		if (thisenv->env_dl_jobs == job)
+			panic("job %u ran again after it ended", job);
+		if (c->env_dl_jobs != thisenv->env_dl_jobs
+		    || c->env_dl_budget != 0)
+			panic("job %u ran before the child's", thisenv->env_dl_jobs);
+		cprintf("job %d\n", i);
+	}
+	if (thisenv->env_dl_misses || c->env_dl_misses)
+		panic("%u and %u deadlines missed",
+		      thisenv->env_dl_misses, c->env_dl_misses);
+
+	sys_env_destroy(child);
+	sys_env_destroy(hog);
+	cprintf("deadline: %d jobs ran ahead of the hog, in deadline order\n",
+		JOBS);
+}
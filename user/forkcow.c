@@ -0,0 +1,39 @@
+// Test copy-on-write sharing between a forked parent and child.
+
+#include <inc/lib.h>
+
+int counter = 1;
+char buf[3 * PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i;
+
+	memset(buf, 'p', sizeof(buf));
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+
+	if (who == 0) {
+		// Child: still sees the parent's data, and may change its copy.
+		if (counter != 1 || buf[PGSIZE] != 'p')
+			panic("child does not see the parent's memory");
+		counter = 2;
+		memset(buf, 'c', sizeof(buf));
+		cprintf("%08x child counter %d\n", thisenv->env_id, counter);
+		return;
+	}
+
+	// Parent: writes go to private copies, and thisenv is unchanged.
+	if (thisenv->env_id != sys_getenvid())
+		panic("parent's thisenv changed");
+	counter = 3;
+	for (i = 0; i < sizeof(buf); i += PGSIZE)
+		buf[i] = 'P';
+	for (i = 0; i < sizeof(buf); i++)
+		if (buf[i] != (i % PGSIZE ? 'p' : 'P'))
+			panic("buf[%d] is %c after copy-on-write", i, buf[i]);
+	cprintf("%08x forked %08x, parent counter %d\n",
+		thisenv->env_id, who, counter);
+}
@@ -0,0 +1,60 @@
+// Compare walking a large array mapped with 4KB pages against the same
+// walk over 4MB pages.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ARRAY_SIZE	(4 * PTSIZE)
+#define SMALL_BASE	0x10000000
+#define LARGE_BASE	0x20000000
+#define PASSES		16
+
+// Touch one word in every page of [base, base + ARRAY_SIZE), PASSES
+// times over, so that nearly every access needs a TLB entry.
+// Returns the cycles per access.
+static uint32_t
+walk(uintptr_t base)
+{
+	volatile uint32_t *p;
+	uint64_t start;
+	uint32_t sum = 0;
+	int pass;
+
+	start = read_tsc();
+	for (pass = 0; pass < PASSES; pass++)
+		for (p = (uint32_t *) base; p < (uint32_t *) (base + ARRAY_SIZE);
+		     p += PGSIZE / sizeof(*p))
+			sum += (*p)++;
+	if (sum != (ARRAY_SIZE / PGSIZE) * PASSES * (PASSES - 1) / 2)
+		panic("walk: bad sum %u", sum);
+	return (read_tsc() - start) / (PASSES * (ARRAY_SIZE / PGSIZE));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uintptr_t va;
+	int r;
+
+	// Write each 4KB page once, so that its copy-on-write fault off
+	// the zero page isn't timed.
+	for (va = SMALL_BASE; va < SMALL_BASE + ARRAY_SIZE; va += PGSIZE) {
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		*(volatile uint32_t *) va = 0;
+	}
+	for (va = LARGE_BASE; va < LARGE_BASE + ARRAY_SIZE; va += PTSIZE)
+		if ((r = sys_page_alloc(0, (void *) va,
+					PTE_P | PTE_U | PTE_W | PTE_PS)) < 0) {
+			cprintf("4MB pages unavailable: %e\n", r);
+			return;
+		}
+	if (!(uvpt_pte((void *) LARGE_BASE) & PTE_PS)
+	    || (uvpt_pte((void *) SMALL_BASE) & PTE_PS))
+		panic("page sizes not as allocated");
+
+	cprintf("Walking %d MB, one word per 4KB page, %d passes\n",
+		ARRAY_SIZE >> 20, PASSES);
+	cprintf("  4KB pages: %u cycles/access\n", walk(SMALL_BASE));
+	cprintf("  4MB pages: %u cycles/access\n", walk(LARGE_BASE));
+}